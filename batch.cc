@@ -0,0 +1,278 @@
+/*************************************************************************
+ * batch.cc - This file is part of zcpp.                                 *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include "zcpp.hh"
+
+/* Preprocessing several input files in one run. Most files of a project
+   begin with the same #include lines, so the longest run of them that
+   every input begins with is found first. The first file processes those
+   includes as usual and keeps the output of each and the macros after
+   it; every other file takes them from there instead. */
+
+class prefix_include
+{
+public:
+  std::string output; /* Without the line marker that follows it */
+  zcpp::macro_table defines;
+};
+
+static std::vector <std::string> prefix; /* Header names, with delimiters */
+static std::vector <prefix_include> recorded;
+static std::size_t next_include; /* Index in prefix of the next #include */
+static unsigned long reported;
+static unsigned long prefix_hits;
+
+bool zcpp::sharing_prefix;
+
+static std::string_view
+trim (std::string_view s)
+{
+  while (!s.empty () && std::isspace (s.front ()))
+    s.remove_prefix (1);
+  while (!s.empty () && std::isspace (s.back ()))
+    s.remove_suffix (1);
+  return s;
+}
+
+/* Returns the header names of the #include lines at the start of the
+   file, before anything but comments and blank lines. A line that needs
+   more than that to be read the same way as the preprocessor does ends
+   the search. */
+
+static std::vector <std::string>
+leading_includes (std::istream &file)
+{
+  std::vector <std::string> specs;
+  std::string line;
+  bool comment = false;
+  while (std::getline (file, line))
+    {
+      if (!line.empty () && line.back () == '\\')
+	break;
+      std::string text;
+      for (std::size_t i = 0; i < line.size (); i++)
+	{
+	  if (comment)
+	    {
+	      if (line.compare (i, 2, "*/") == 0)
+		{
+		  comment = false;
+		  text += ' ';
+		  i++;
+		}
+	    }
+	  else if (line.compare (i, 2, "/*") == 0)
+	    {
+	      comment = true;
+	      i++;
+	    }
+	  else
+	    text += line[i];
+	}
+
+      std::string_view s = trim (text);
+      if (s.empty ())
+	continue;
+      if (s[0] != '#')
+	break;
+      s = trim (s.substr (1));
+      if (s.compare (0, 7, "include") != 0 || s.size () < 8
+	  || !std::isspace (s[7]))
+	break;
+      s = trim (s.substr (7));
+      if (s.size () < 3 || (s[0] != '<' && s[0] != '"')
+	  || s.back () != (s[0] == '<' ? '>' : '"')
+	  || s.find (s.back (), 1) != s.size () - 1)
+	break;
+
+      /* A comment marker in the header name is not a comment */
+      if (line.find (s) == std::string::npos)
+	break;
+      specs.emplace_back (s);
+    }
+  return specs;
+}
+
+static void
+find_prefix (const std::vector <std::string> &inputs)
+{
+  bool first = true;
+  for (const std::string &filename : inputs)
+    {
+      std::unique_ptr <std::istream> file = zcpp::files->open (filename);
+      if (file == nullptr)
+	continue;
+      std::vector <std::string> specs = leading_includes (*file);
+      if (first)
+	prefix = std::move (specs);
+      else
+	{
+	  std::size_t n = 0;
+	  while (n < prefix.size () && n < specs.size ()
+		 && prefix[n] == specs[n])
+	    n++;
+	  prefix.resize (n);
+	}
+      first = false;
+    }
+}
+
+/* Uses the output and macros kept for an #include of the main file, if
+   it is part of the shared prefix and they are known */
+
+bool
+zcpp::splice_prefix (std::string &result, std::string_view content)
+{
+  if (next_include >= prefix.size () || trim (content) != prefix[next_include])
+    {
+      zcpp::sharing_prefix = false;
+      return false;
+    }
+  if (next_include >= recorded.size ())
+    {
+      reported = zcpp::diagnostics_reported ();
+      return false;
+    }
+  const prefix_include &include = recorded[next_include++];
+  result += include.output;
+  zcpp::charge_line (include.output.size ());
+  zcpp::defines = include.defines;
+  result += zcpp::stamp_file ();
+  zcpp::sharing_prefix = next_include < prefix.size ();
+  prefix_hits++;
+  return true;
+}
+
+/* Keeps the output of an #include of the shared prefix that was just
+   processed. An include that showed a message ends the prefix, since
+   the message would not be shown again for the other files. */
+
+void
+zcpp::record_prefix (const std::string &result, std::size_t length)
+{
+  if (!zcpp::sharing_prefix)
+    return;
+  std::string_view output = std::string_view (result).substr (length);
+  std::string stamp = zcpp::stamp_file ();
+  if (zcpp::exiting || zcpp::diagnostics_reported () != reported
+      || output.size () < stamp.size ()
+      || output.substr (output.size () - stamp.size ()) != stamp)
+    {
+      prefix.resize (recorded.size ());
+      zcpp::sharing_prefix = false;
+      return;
+    }
+  recorded.push_back (prefix_include ());
+  recorded.back ().output = output.substr (0, output.size () - stamp.size ());
+  recorded.back ().defines = zcpp::defines;
+  next_include++;
+  zcpp::sharing_prefix = next_include < prefix.size ();
+}
+
+/* Writes each input to a file in dir named after it. Quoted includes are
+   searched for in the directory of the input, which must be the same for
+   all of them. */
+
+int
+zcpp::preprocess_batch (const std::vector <std::string> &inputs,
+			const std::string &dir)
+{
+  std::filesystem::path parent =
+    std::filesystem::path (inputs.front ()).parent_path ();
+  std::set <std::string> names;
+  std::vector <std::string> outputs;
+  for (const std::string &filename : inputs)
+    {
+      std::filesystem::path path (filename);
+      if (path.parent_path () != parent)
+	zcpp::error ("input files of " + zcpp::bold ("--batch") +
+		     " must be in the same directory");
+      std::string name = path.stem ().string () + ".i";
+      if (!names.insert (name).second)
+	zcpp::error ("more than one input file would be written to " +
+		     zcpp::bold (name));
+      outputs.push_back ((std::filesystem::path (dir) / name).string ());
+    }
+  if (zcpp::exiting)
+    return 1;
+
+  find_prefix (inputs);
+  zcpp::macro_table baseline = zcpp::defines;
+  int status = 0;
+  for (std::size_t i = 0; i < inputs.size (); i++)
+    {
+      zcpp::exiting = false;
+      std::unique_ptr <std::istream> file = zcpp::files->open (inputs[i]);
+      if (file == nullptr)
+	{
+	  zcpp::error ("failed to open input file " + zcpp::bold (inputs[i]) +
+		       ": " + std::strerror (errno));
+	  zcpp::flush_diagnostics ();
+	  status = 1;
+	  continue;
+	}
+      zcpp::defines = baseline;
+      next_include = 0;
+      zcpp::sharing_prefix = !prefix.empty ();
+      zcpp::start_budget ();
+      std::string result;
+      try
+	{
+	  result = zcpp::preprocess (inputs[i], *file);
+	}
+      catch (const zcpp::fatal_error &)
+	{
+	  zcpp::abandon_files ();
+	}
+      zcpp::sharing_prefix = false;
+      zcpp::flush_diagnostics ();
+      if (zcpp::exiting)
+	{
+	  status = 1;
+	  continue;
+	}
+
+      std::ofstream output (outputs[i], std::ios::binary);
+      if (zcpp::emit_tokens)
+	zcpp::write_tokens (result, output);
+      else
+	output << result;
+      output.close ();
+      if (!output.good ())
+	{
+	  zcpp::error ("failed to write output file " +
+		       zcpp::bold (outputs[i]) + ": " +
+		       std::strerror (errno));
+	  zcpp::flush_diagnostics ();
+	  status = 1;
+	}
+    }
+  if (zcpp::verbose && !prefix.empty ())
+    std::cerr << "Leading includes shared between input files: "
+	      << prefix.size () << " (reused " << prefix_hits << " times)"
+	      << std::endl;
+  return status;
+}
@@ -0,0 +1,70 @@
+/*************************************************************************
+ * budget.cc - This file is part of zcpp.                                *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <chrono>
+#include "zcpp.hh"
+
+std::size_t zcpp::max_include_depth = 200;
+std::size_t zcpp::max_expansion = 64 * 1024 * 1024;
+std::uintmax_t zcpp::max_output = (std::uintmax_t) 4 * 1024 * 1024 * 1024;
+unsigned long zcpp::max_time = 600;
+
+std::uintmax_t zcpp::output_bytes;
+unsigned long zcpp::lines_charged;
+
+static std::chrono::steady_clock::time_point start_time;
+
+void
+zcpp::start_budget (void)
+{
+  zcpp::output_bytes = 0;
+  start_time = std::chrono::steady_clock::now ();
+}
+
+void
+zcpp::check_budget (void)
+{
+  if (zcpp::output_bytes > zcpp::max_output)
+    zcpp::fatal ("output exceeds " + std::to_string (zcpp::max_output) +
+		 " bytes (use " + zcpp::bold ("--max-output") +
+		 " to increase the limit)");
+  if (zcpp::max_time > 0
+      && std::chrono::steady_clock::now () - start_time
+      > std::chrono::seconds (zcpp::max_time))
+    zcpp::fatal ("preprocessing took longer than " +
+		 std::to_string (zcpp::max_time) + " seconds (use " +
+		 zcpp::bold ("--max-time") + " to increase the limit)");
+}
+
+void
+zcpp::check_include_depth (void)
+{
+  if (zcpp::filestack.size () > zcpp::max_include_depth)
+    zcpp::fatal ("#include nested more than " +
+		 std::to_string (zcpp::max_include_depth) + " deep (use " +
+		 zcpp::bold ("-fmax-include-depth") +
+		 " to increase the limit)");
+}
+
+[[noreturn]] void
+zcpp::expansion_too_long (void)
+{
+  zcpp::fatal ("macro expansion adds more than " +
+	       std::to_string (zcpp::max_expansion) + " bytes to a line (use " +
+	       zcpp::bold ("--max-expansion") + " to increase the limit)");
+}
@@ -0,0 +1,271 @@
+/*************************************************************************
+ * cache.cc - This file is part of zcpp.                                 *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include "zcpp.hh"
+
+/* Each entry is named after a hash of the main file, its name, the
+   include search path and the predefined macros. It lists every file
+   that was included together with a hash of its contents, every header
+   that was searched for with the file it was found in, and the messages
+   that were reported, followed by the output. An entry is only used if
+   all of those files are unchanged and every header is still found in
+   the same place, and then its messages are reported again. */
+
+#define CACHE_MAGIC "zcpp-cache 2"
+#define CACHE_SUFFIX ".zc"
+
+namespace fs = std::filesystem;
+
+std::string zcpp::cache_dir;
+std::uintmax_t zcpp::cache_size = 1024 * 1024 * 1024;
+
+static std::string entry_key;
+static std::vector <std::pair <std::string, std::string>> included;
+
+/* The file each header was found in, or empty if it was not found, by
+   header name and the index of the first directory searched */
+static std::map <std::pair <std::string, std::size_t>, std::string> searches;
+static std::vector <zcpp::message> messages;
+
+static std::string
+entry_path (void)
+{
+  return zcpp::cache_dir + '/' + entry_key.substr (0, 2) + '/' + entry_key +
+    CACHE_SUFFIX;
+}
+
+static std::string
+hash_contents (std::string_view contents)
+{
+  zcpp::hash h;
+  h.update (contents.data (), contents.size ());
+  return h.hex ();
+}
+
+static bool
+file_matches (const std::string &filename, const std::string &expected)
+{
+  std::string_view data;
+  if (zcpp::files->view (filename, data))
+    return hash_contents (data) == expected;
+  std::unique_ptr <std::istream> file = zcpp::files->open (filename);
+  if (file == nullptr)
+    return false;
+  std::ostringstream stream;
+  stream << file->rdbuf ();
+  return hash_contents (stream.str ()) == expected;
+}
+
+static bool
+entry_valid (std::istream &entry)
+{
+  std::string line;
+  if (!entry.good () || !std::getline (entry, line) || line != CACHE_MAGIC
+      || !std::getline (entry, line))
+    return false;
+  std::size_t count = std::strtoul (line.c_str (), nullptr, 10);
+  for (std::size_t i = 0; i < count; i++)
+    {
+      if (!std::getline (entry, line) || line.size () < 34
+	  || !file_matches (line.substr (33), line.substr (0, 32)))
+	return false;
+    }
+
+  if (!std::getline (entry, line))
+    return false;
+  count = std::strtoul (line.c_str (), nullptr, 10);
+  for (std::size_t i = 0; i < count; i++)
+    {
+      std::string expected;
+      if (!std::getline (entry, line) || !std::getline (entry, expected))
+	return false;
+      std::size_t sep = line.find (' ');
+      if (sep == std::string::npos || sep + 3 > line.size ())
+	return false;
+      std::string filename;
+      zcpp::find_include (line.substr (sep + 1),
+			  std::strtoul (line.c_str (), nullptr, 10),
+			  filename);
+      if (filename != expected)
+	return false;
+    }
+
+  if (!std::getline (entry, line))
+    return false;
+  count = std::strtoul (line.c_str (), nullptr, 10);
+  messages.clear ();
+  for (std::size_t i = 0; i < count; i++)
+    {
+      zcpp::message m;
+      char *end;
+      if (!std::getline (entry, line) || line.size () < 4
+	  || !std::getline (entry, m.text))
+	return false;
+      m.is_error = line[0] == 'e';
+      m.line = std::strtoul (line.c_str () + 2, &end, 10);
+      if (*end != ' ')
+	return false;
+      m.filename = end + 1;
+      messages.push_back (std::move (m));
+    }
+  return true;
+}
+
+bool
+zcpp::cache_lookup (const std::string &filename, const std::string &contents,
+		    std::ostream &output)
+{
+  zcpp::hash h;
+  h.update (CACHE_MAGIC PROJECT_VERSION);
+  h.update (filename);
+  h.update (contents);
+  zcpp::add_system_includes ();
+  for (const zcpp::include &dir : zcpp::includes)
+    {
+      h.update (dir.path);
+      h.update (std::to_string (dir.type));
+    }
+  std::pair <std::uint64_t, std::uint64_t> macros =
+    zcpp::defines.fingerprint ();
+  h.update (std::to_string (macros.first) + ' ' +
+	    std::to_string (macros.second));
+  entry_key = h.hex ();
+
+  std::string path = entry_path ();
+  std::ifstream entry (path, std::ios::binary);
+  bool valid = entry_valid (entry);
+
+  /* Checking the searches looked the headers up again */
+  included.clear ();
+  searches.clear ();
+  if (!valid)
+    {
+      messages.clear ();
+      zcpp::keep_messages (&messages);
+      return false;
+    }
+
+  for (const zcpp::message &m : messages)
+    zcpp::report_again (m);
+  messages.clear ();
+  output << entry.rdbuf ();
+  std::error_code ec;
+  fs::last_write_time (path, fs::file_time_type::clock::now (), ec);
+  if (zcpp::verbose)
+    std::cerr << "Output read from cache " << path << std::endl;
+  return true;
+}
+
+void
+zcpp::cache_include (const std::string &filename,
+		     std::string_view contents)
+{
+  if (!zcpp::cache_dir.empty ())
+    included.emplace_back (filename, hash_contents (contents));
+}
+
+void
+zcpp::cache_search (const std::string &spec, std::size_t start,
+		    const std::string &filename)
+{
+  if (!zcpp::cache_dir.empty ())
+    searches.emplace (std::make_pair (spec, start), filename);
+}
+
+/* Removes the least recently used entries until the cache is 10% below
+   its size limit */
+
+static void
+evict (void)
+{
+  std::vector <std::pair <fs::file_time_type, fs::path>> entries;
+  std::uintmax_t total = 0;
+  std::error_code ec;
+  for (fs::recursive_directory_iterator it (zcpp::cache_dir, ec), end;
+       !ec && it != end; it.increment (ec))
+    {
+      if (!it->is_regular_file (ec) || it->path ().extension () != CACHE_SUFFIX)
+	continue;
+      total += it->file_size (ec);
+      entries.emplace_back (it->last_write_time (ec), it->path ());
+    }
+  if (total <= zcpp::cache_size)
+    return;
+
+  std::sort (entries.begin (), entries.end ());
+  for (const std::pair <fs::file_time_type, fs::path> &entry : entries)
+    {
+      if (total <= zcpp::cache_size / 10 * 9)
+	break;
+      std::uintmax_t size = fs::file_size (entry.second, ec);
+      if (fs::remove (entry.second, ec))
+	total -= size;
+    }
+}
+
+void
+zcpp::cache_store (const std::string &result)
+{
+  zcpp::keep_messages (nullptr);
+
+  /* Markers for embedded resources only mean something to this process */
+  if (!zcpp::embedded.empty ())
+    return;
+  std::string path = entry_path ();
+  std::error_code ec;
+  fs::create_directories (fs::path (path).parent_path (), ec);
+
+  /* Write to a private file first so that other processes only ever see
+     complete entries */
+  std::string temp = path + ".tmp" + std::to_string (getpid ());
+  std::ofstream entry (temp, std::ios::binary);
+  entry << CACHE_MAGIC << '\n' << included.size () << '\n';
+  for (const std::pair <std::string, std::string> &file : included)
+    entry << file.second << ' ' << file.first << '\n';
+  entry << searches.size () << '\n';
+  for (const std::pair <const std::pair <std::string, std::size_t>,
+	 std::string> &search : searches)
+    entry << search.first.second << ' ' << search.first.first << '\n'
+	  << search.second << '\n';
+  entry << messages.size () << '\n';
+  for (const zcpp::message &m : messages)
+    entry << (m.is_error ? 'e' : 'w') << ' ' << m.line << ' ' << m.filename
+	  << '\n' << m.text << '\n';
+  entry << result;
+  entry.close ();
+  if (!entry.good () || std::rename (temp.c_str (), path.c_str ()) != 0)
+    {
+      zcpp::warning ("failed to write cache entry " + zcpp::bold (path) +
+		     ": " + std::strerror (errno));
+      std::remove (temp.c_str ());
+      return;
+    }
+
+  /* Walking the whole cache is slow, so only check its size after about
+     one in sixteen new entries */
+  if (entry_key[0] == '0')
+    evict ();
+}
@@ -16,80 +16,519 @@
  * along with this program. If not, see <https://www.gnu.org/licenses/>. *
  *************************************************************************/
 
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstring>
+#include <sstream>
+#include <thread>
 #include "zcpp.hh"
 
-std::string
-zcpp::replace_comments_escapes (void)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Number of bytes read from the file at a time */
+#define STRIP_BLOCK 65536
+
+/* Files at least this large are split into pieces that are stripped on
+   separate threads */
+#define STRIP_PARALLEL_MIN (4 * 1024 * 1024)
+
+/* Smallest piece given to a thread */
+#define STRIP_PIECE_MIN (1024 * 1024)
+
+#ifdef __SSE2__
+
+static inline unsigned int
+match_mask (__m128i x, __m128i a, __m128i b, __m128i c, __m128i d)
 {
-  std::string result;
-  int c = zcpp::next_char ();
-  int last = '\0';
-  int realign = 0;
-  while (c != EOF)
+  __m128i m = _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (x, a),
+					  _mm_cmpeq_epi8 (x, b)),
+			    _mm_or_si128 (_mm_cmpeq_epi8 (x, c),
+					  _mm_cmpeq_epi8 (x, d)));
+  return (unsigned int) _mm_movemask_epi8 (m);
+}
+
+#endif
+
+/* Returns the offset of the first of the given bytes in p, or n if there
+   is none. Most text has none of them, so 32 bytes are checked at a
+   time. */
+
+static std::size_t
+find_any (const char *p, std::size_t n, char a, char b, char c, char d)
+{
+  std::size_t i = 0;
+#ifdef __SSE2__
+  __m128i va = _mm_set1_epi8 (a);
+  __m128i vb = _mm_set1_epi8 (b);
+  __m128i vc = _mm_set1_epi8 (c);
+  __m128i vd = _mm_set1_epi8 (d);
+  for (; i + 32 <= n; i += 32)
+    {
+      __m128i x = _mm_loadu_si128 ((const __m128i *) (p + i));
+      __m128i y = _mm_loadu_si128 ((const __m128i *) (p + i + 16));
+      unsigned int mask = match_mask (x, va, vb, vc, vd) |
+	match_mask (y, va, vb, vc, vd) << 16;
+      if (mask != 0)
+	return i + __builtin_ctz (mask);
+    }
+#endif
+  for (; i < n; i++)
+    {
+      if (p[i] == a || p[i] == b || p[i] == c || p[i] == d)
+	return i;
+    }
+  return n;
+}
+
+static std::size_t
+count_newlines (const char *p, std::size_t n)
+{
+  std::size_t count = 0;
+  std::size_t i = 0;
+#ifdef __SSE2__
+  __m128i nl = _mm_set1_epi8 ('\n');
+  for (; i + 32 <= n; i += 32)
+    {
+      __m128i x = _mm_loadu_si128 ((const __m128i *) (p + i));
+      __m128i y = _mm_loadu_si128 ((const __m128i *) (p + i + 16));
+      unsigned int lo = _mm_movemask_epi8 (_mm_cmpeq_epi8 (x, nl));
+      unsigned int hi = _mm_movemask_epi8 (_mm_cmpeq_epi8 (y, nl));
+      count += __builtin_popcount (lo | hi << 16);
+    }
+#endif
+  return count + std::count (p + i, p + n, '\n');
+}
+
+zcpp::comment_stripper::comment_stripper (translation_unit &unit,
+					  bool defer) :
+  unit (unit), defer (defer), pos (0), partial (false)
+{
+  in_memory = zcpp::memory_view (unit.file, text);
+}
+
+/* Strips a piece of the file that starts with the given constructs
+   open. Unless it is the end of the file, a comment still open at the
+   end is left open instead of being reported. */
+
+zcpp::comment_stripper::comment_stripper (translation_unit &unit,
+					  std::string_view text,
+					  const state &entry, bool partial) :
+  unit (unit), defer (true), text (text), in_memory (true), pos (0),
+  open (entry), partial (partial)
+{
+}
+
+/* Reads more of the file, keeping the part of the buffer not yet used.
+   Returns false if there was nothing left to read. */
+
+bool
+zcpp::comment_stripper::fill (void)
+{
+  if (in_memory)
+    return false;
+  buffer.erase (0, pos);
+  pos = 0;
+  std::size_t size = buffer.size ();
+  buffer.resize (size + STRIP_BLOCK);
+  unit.file.read (&buffer[size], STRIP_BLOCK);
+  buffer.resize (size + unit.file.gcount ());
+  text = buffer;
+  return buffer.size () > size;
+}
+
+bool
+zcpp::comment_stripper::ensure (std::size_t n)
+{
+  while (text.size () - pos < n)
+    {
+      if (!fill ())
+	return false;
+    }
+  return true;
+}
+
+/* Handles the backslash at pos. A backslash followed by nothing but
+   whitespace before the end of the line joins the next line to this one,
+   otherwise it is copied along with the character after it. Returns
+   false at the end of the file. */
+
+bool
+zcpp::comment_stripper::splice (std::string &result)
+{
+  std::size_t i = 1;
+  while (true)
+    {
+      if (!ensure (i + 1))
+	{
+	  report (false, "ignoring backslash at end of file");
+	  pos = text.size ();
+	  return false;
+	}
+      char c = text[pos + i];
+      if (c == '\n')
+	{
+	  unit.line++;
+	  open.realign++;
+	  pos += i + 1;
+	  return true;
+	}
+      if (!std::isspace ((unsigned char) c))
+	break;
+      i++;
+    }
+  result.append (text, pos, i + 1);
+  pos += i + 1;
+  return true;
+}
+
+/* Replaces the rest of an open comment with spaces, keeping its newlines
+   so that line numbers don't change */
+
+bool
+zcpp::comment_stripper::skip_comment (std::string &result)
+{
+  while (true)
+    {
+      const char *p = text.data () + pos;
+      std::size_t n = text.size () - pos;
+      std::size_t span = find_any (p, n, '*', '*', '*', '*');
+      std::size_t base = result.size ();
+      result.resize (base + span);
+      for (std::size_t i = 0; i < span; i++)
+	result[base + i] = p[i] == '\n' ? '\n' : ' ';
+      unit.line += count_newlines (p, span);
+      pos += span;
+
+      if (span == n)
+	{
+	  if (fill ())
+	    continue;
+	}
+      else if (!ensure (2))
+	{
+	  result += ' ';
+	  pos++;
+	}
+      else if (text[pos + 1] == '/')
+	{
+	  result += "  ";
+	  pos += 2;
+	  open.comment = false;
+	  return true;
+	}
+      else
+	{
+	  result += ' ';
+	  pos++;
+	  continue;
+	}
+      if (!partial)
+	report (true, "unterminated comment");
+      return false;
+    }
+}
+
+void
+zcpp::comment_stripper::report (bool is_error, std::string msg)
+{
+  if (defer)
+    messages.emplace_back (is_error, std::move (msg));
+  else if (is_error)
+    zcpp::error (unit, msg);
+  else
+    zcpp::warning (unit, msg);
+}
+
+void
+zcpp::comment_stripper::flush_messages (void)
+{
+  for (std::pair <bool, std::string> &msg : messages)
+    {
+      if (msg.first)
+	zcpp::error (unit, msg.second);
+      else
+	zcpp::warning (unit, msg.second);
+    }
+  messages.clear ();
+}
+
+/* A quote right after a letter, digit or underscore is a digit separator
+   as in 1'000 or an apostrophe in the text of a #warning, unless what
+   comes before it is an encoding prefix such as L or u8 */
+
+static bool
+opens_char_literal (const std::string &result)
+{
+  std::size_t size = result.size ();
+  std::size_t len = 0;
+  while (len < 3 && len < size
+	 && (std::isalnum ((unsigned char) result[size - len - 1])
+	     || result[size - len - 1] == '_'))
+    len++;
+  if (len == 0)
+    return true;
+  if (len == 3)
+    return false;
+  std::string_view word (result.data () + size - len, len);
+  return word == "L" || word == "u" || word == "U" || word == "u8";
+}
+
+/* Returns true if the character literal opened by the quote at pos is
+   closed on the same line. One that is not is taken as a lone quote, so
+   that comments after it are still found. */
+
+bool
+zcpp::comment_stripper::literal_closes (void)
+{
+  std::size_t i = 1;
+  while (ensure (i + 1))
     {
-      if (c == '/')
+      char c = text[pos + i];
+      if (c == '\'')
+	return true;
+      if (c == '\n')
+	return false;
+      i += c == '\\' ? 2 : 1;
+    }
+  return false;
+}
+
+/* Appends to result until the end of the input, or until result is at
+   least limit bytes long and ends at a line boundary. Returns true if
+   there is more input left. Text between the bytes that matter is copied
+   in bulk. Comment markers inside string and character literals are left
+   alone; a string literal that is not closed ends at the end of its
+   line. */
+
+bool
+zcpp::comment_stripper::run (std::string &result, std::size_t limit)
+{
+  char &quote = open.quote;
+  if (open.comment && !skip_comment (result))
+    return false;
+  while (ensure (1))
+    {
+      const char *p = text.data () + pos;
+      std::size_t n = text.size () - pos;
+      std::size_t span;
+      if (quote != '\0')
+	span = find_any (p, n, quote, '\\', '\n', '\n');
+      else
 	{
-	  c = zcpp::next_char ();
-	  if (c == '*')
+	  span = find_any (p, n, '/', '\\', '"', '\'');
+
+	  /* Newlines only matter when line numbers need to be realigned
+	     after a splice or when the chunk could end */
+	  if (open.realign > 0 || result.size () + span >= limit)
 	    {
-	      result += ' ';
-	      while (last != '*' || c != '/')
-		{
-		  if (c == EOF)
-		    {
-		      zcpp::error ("unterminated comment");
-		      return result;
-		    }
-		  else if (c == '\n')
-		    result += '\n';
-		  else
-		    result += ' ';
-		  last = c;
-		  c = zcpp::next_char ();
-		}
-	      result += ' ';
-	      last = '\0';
+	      const void *nl = std::memchr (p, '\n', span);
+	      if (nl != nullptr)
+		span = (const char *) nl - p;
 	    }
-	  else
+	  unit.line += count_newlines (p, span);
+	}
+      result.append (p, span);
+      pos += span;
+      if (span == n)
+	continue;
+
+      char c = text[pos];
+      if (c == '\n')
+	{
+	  pos++;
+	  unit.line++;
+	  quote = '\0';
+	  result += '\n';
+	  if (open.realign > 0)
 	    {
-	      result += '/';
-	      continue;
+	      result += zcpp::stamp_file (unit);
+	      open.realign = 0;
 	    }
+	  if (result.size () >= limit)
+	    return ensure (1);
 	}
       else if (c == '\\')
 	{
-	  std::string fail;
-	  do
-	    {
-	      c = zcpp::next_char ();
-	      fail += c;
-	    }
-	  while (std::isspace (c) && c != '\n');
-	  if (c == EOF)
-	    {
-	      zcpp::warning ("ignoring backslash at end of file");
-	      return result;
-	    }
-	  if (c == '\n')
-	    {
-	      c = zcpp::next_char ();
-	      realign++;
-	      continue;
-	    }
-	  else
-	    result += '\\' + fail;
+	  if (!splice (result))
+	    return false;
 	}
-      else
+      else if (quote != '\0' || c == '"'
+	       || (c == '\'' && opens_char_literal (result)
+		   && literal_closes ()))
 	{
+	  quote = quote == '\0' ? c : '\0';
 	  result += c;
-	  last = c;
-	  if (c == '\n' && realign > 0)
-	    {
-	      result += zcpp::stamp_file ();
-	      realign = 0;
-	    }
+	  pos++;
+	}
+      else if (c == '\'')
+	{
+	  result += c;
+	  pos++;
+	}
+      else if (ensure (2) && text[pos + 1] == '*')
+	{
+	  result += "  ";
+	  pos += 2;
+	  open.comment = true;
+	  if (!skip_comment (result))
+	    return false;
+	}
+      else
+	{
+	  result += '/';
+	  pos++;
+	}
+    }
+  return false;
+}
+
+/* Until it is set, one per processor. Finding out how many there are
+   reads from the file system, so it waits until a large file needs it. */
+unsigned int zcpp::strip_threads = UINT_MAX;
+
+static unsigned int
+strip_thread_count (void)
+{
+  if (zcpp::strip_threads == UINT_MAX)
+    zcpp::strip_threads = std::thread::hardware_concurrency ();
+  return zcpp::strip_threads;
+}
+
+/* A piece of a file starting at a line boundary. It is first stripped
+   assuming nothing is open where it starts, which is almost always true,
+   and again once the real state at its start is known if that was
+   wrong. */
+
+class strip_piece
+{
+public:
+  std::string_view text;
+  std::size_t line;
+  bool last;
+  std::istringstream empty;
+  std::unique_ptr <zcpp::translation_unit> unit;
+  std::unique_ptr <zcpp::comment_stripper> stripper;
+  zcpp::comment_stripper::state entry;
+  std::string output;
+
+  void
+  strip (const std::string &filename)
+  {
+    unit = std::make_unique <zcpp::translation_unit> (filename, empty);
+    unit->line = line;
+    stripper = std::make_unique <zcpp::comment_stripper> (*unit, text, entry,
+							   !last);
+    output.clear ();
+    stripper->run (output, std::string::npos);
+  }
+};
+
+/* Reads the rest of the file if it is worth splitting, otherwise leaves
+   it untouched and returns false */
+
+static bool
+read_large_file (std::istream &file, std::string &input)
+{
+  std::streambuf *buf = file.rdbuf ();
+  std::streamoff start = buf->pubseekoff (0, std::ios::cur, std::ios::in);
+  std::streamoff end = buf->pubseekoff (0, std::ios::end, std::ios::in);
+  if (start < 0 || end < 0)
+    return false;
+  buf->pubseekpos (start, std::ios::in);
+  if (end - start < STRIP_PARALLEL_MIN)
+    return false;
+
+  input.resize (end - start);
+  file.read (&input[0], input.size ());
+  input.resize (file.gcount ());
+  return true;
+}
+
+static std::string
+strip_parallel (zcpp::translation_unit &unit, std::string_view input)
+{
+  std::size_t count = 1;
+  while (count < std::min ((std::size_t) zcpp::strip_threads,
+			   input.size () / STRIP_PIECE_MIN)
+	 && zcpp::acquire_job ())
+    count++;
+  std::vector <std::unique_ptr <strip_piece>> pieces;
+  std::size_t start = 0;
+  std::size_t line = unit.line;
+  for (std::size_t i = 1; i <= count && start < input.size (); i++)
+    {
+      std::size_t end = input.size ();
+      if (i < count)
+	{
+	  end = input.find ('\n', std::max (start, input.size () / count * i));
+	  end = end == std::string::npos ? input.size () : end + 1;
 	}
-      c = zcpp::next_char ();
+      pieces.push_back (std::make_unique <strip_piece> ());
+      strip_piece &piece = *pieces.back ();
+      piece.text = input.substr (start, end - start);
+      piece.line = line;
+      piece.last = end == input.size ();
+      line += count_newlines (piece.text.data (), piece.text.size ());
+      start = end;
+    }
+
+  std::vector <std::thread> threads;
+  for (std::size_t i = 1; i < pieces.size (); i++)
+    threads.emplace_back (&strip_piece::strip, pieces[i].get (),
+			  std::cref (unit.filename));
+  pieces[0]->strip (unit.filename);
+  for (std::thread &t : threads)
+    t.join ();
+  for (std::size_t i = 1; i < count; i++)
+    zcpp::release_job ();
+
+  std::string result;
+  zcpp::comment_stripper::state open;
+  for (std::unique_ptr <strip_piece> &piece : pieces)
+    {
+      if (!(piece->entry == open))
+	{
+	  piece->entry = open;
+	  piece->strip (unit.filename);
+	}
+      result += piece->output;
+      piece->stripper->flush_messages ();
+      open = piece->stripper->exit_state ();
+      unit.line = piece->unit->line;
+    }
+  return result;
+}
+
+std::string
+zcpp::replace_comments_escapes (void)
+{
+  zcpp::translation_unit &unit = *zcpp::filestack.top ();
+  std::string storage;
+  std::string_view input;
+  bool whole = zcpp::memory_view (unit.file, input);
+  if (!whole && zcpp::strip_threads > 1
+      && read_large_file (unit.file, storage))
+    {
+      input = storage;
+      whole = true;
+    }
+  if (whole && input.size () >= STRIP_PARALLEL_MIN
+      && strip_thread_count () > 1)
+    return strip_parallel (unit, input);
+
+  std::string result;
+  if (whole)
+    {
+      zcpp::comment_stripper::state start;
+      zcpp::comment_stripper stripper (unit, input, start, false);
+      stripper.run (result, std::string::npos);
+      stripper.flush_messages ();
+      return result;
     }
+  zcpp::comment_stripper stripper (unit);
+  stripper.run (result, std::string::npos);
   return result;
 }
@@ -0,0 +1,75 @@
+/*************************************************************************
+ * configs.cc - This file is part of zcpp.                               *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include "zcpp.hh"
+
+/* Preprocessing the input once for each configuration. Every file is
+   only read and stripped of comments once, and include lookups are
+   cached already. Every file included is recorded as a region, so a
+   later configuration whose macros match everything the file read gets
+   the same output and effects without processing it again. A file that
+   reported any message is never kept as a region, so that every
+   configuration reports it again. */
+
+std::vector <zcpp::configuration> zcpp::configs;
+static std::map <std::string, std::string> stage1_cache;
+
+std::string *
+zcpp::config_file (const std::string &filename)
+{
+  return &stage1_cache[filename];
+}
+
+int
+zcpp::preprocess_configs (const std::string &filename, std::istream &file)
+{
+  zcpp::macro_table baseline = zcpp::defines;
+  for (const zcpp::configuration &config : zcpp::configs)
+    {
+      zcpp::defines = baseline;
+      for (const std::pair <std::string, std::string> &def : config.macros)
+	zcpp::define (def.first, def.second);
+      zcpp::start_budget ();
+      std::string result = zcpp::preprocess (filename, file);
+      zcpp::flush_diagnostics ();
+      if (zcpp::exiting)
+	return 1;
+
+      std::ofstream output (config.output, std::ios::binary);
+      if (zcpp::emit_tokens)
+	zcpp::write_tokens (result, output);
+      else
+	output << result;
+      output.close ();
+      if (!output.good ())
+	{
+	  zcpp::error ("failed to write output file " +
+		       zcpp::bold (config.output) + ": " +
+		       std::strerror (errno));
+	  return 1;
+	}
+    }
+  if (zcpp::verbose && zcpp::regions_entered > 0)
+    std::cerr << "Include regions shared between configurations: "
+	      << zcpp::regions_replayed << " of " << zcpp::regions_entered
+	      << std::endl;
+  return 0;
+}
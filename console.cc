@@ -16,57 +16,267 @@
  * along with this program. If not, see <https://www.gnu.org/licenses/>. *
  *************************************************************************/
 
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <mutex>
+#include <tuple>
 #include <unistd.h>
 #include "zcpp.hh"
 
+/* Messages are kept until the end of each translation unit, or until the
+   program exits, and then written all at once. A message that is the
+   same as an earlier one at the same place is dropped, and only the
+   first max_messages of each kind are written, followed by a count of
+   the rest. The kind of a message is its text up to the first colon with
+   any quoted names left out, so "redefining macro: X" and "redefining
+   macro: Y" are the same kind, and so are "'-o' requires an argument"
+   and "'-I' requires an argument". */
+
+class diagnostic
+{
+public:
+  bool is_error;
+  std::string filename;
+  std::size_t line;
+  std::string kind;
+  std::string msg;
+};
+
+/* Never freed, since messages are written when the program exits */
+
+struct diagnostics_state
+{
+  std::mutex lock;
+  std::vector <diagnostic> pending;
+  std::set <std::tuple <bool, std::string, std::size_t, std::string>> seen;
+  std::map <std::pair <bool, std::string>, unsigned long> counts;
+};
+
+static diagnostics_state &diags = *new diagnostics_state;
 static bool tty;
+static unsigned long reported; /* Including messages that were dropped */
+static bool silenced;
+static std::vector <zcpp::message> *kept;
 
 bool zcpp::exiting;
+bool zcpp::verbose;
+bool zcpp::json_diagnostics;
+unsigned long zcpp::max_messages = 20;
 
 void
 zcpp::init_console (void)
 {
   tty = isatty (STDERR_FILENO);
+  std::atexit (zcpp::flush_diagnostics);
 }
 
 std::string
 zcpp::bold (std::string s)
 {
-  if (tty)
+  if (tty && !zcpp::json_diagnostics)
     return "\033[1m" + s + "\033[0m";
   return '\'' + s + '\'';
 }
 
-void
-zcpp::warning (std::string msg)
+static std::string
+message_kind (const std::string &msg)
+{
+  std::string kind;
+  for (std::size_t i = 0; i < msg.size () && msg[i] != ':'; i++)
+    {
+      std::size_t end = std::string::npos;
+      if (msg[i] == '\'')
+	end = msg.find ('\'', i + 1);
+      else if (msg.compare (i, 4, "\033[1m") == 0)
+	end = msg.find ("\033[0m", i + 4);
+      if (end == std::string::npos)
+	{
+	  if (msg[i] != ' ' || (!kind.empty () && kind.back () != ' '))
+	    kind += msg[i];
+	  continue;
+	}
+      i = msg[end] == '\'' ? end : end + 3; /* The last byte of the name */
+    }
+  while (!kind.empty () && kind.back () == ' ')
+    kind.pop_back ();
+  return kind;
+}
+
+static void
+report (bool is_error, const std::string &filename, std::size_t line,
+	std::string msg)
+{
+  std::lock_guard <std::mutex> guard (diags.lock);
+  reported++;
+  if (kept != nullptr)
+    kept->push_back ({is_error, filename, line, msg});
+  if (!diags.seen.emplace (is_error, filename, line, msg).second)
+    return;
+  std::string kind = message_kind (msg);
+  unsigned long &count = diags.counts[std::make_pair (is_error, kind)];
+  if (++count > zcpp::max_messages && zcpp::max_messages > 0)
+    return;
+  diags.pending.push_back ({is_error, filename, line, std::move (kind),
+			    std::move (msg)});
+}
+
+static std::string
+json_string (const std::string &s)
+{
+  std::string result = "\"";
+  for (char c : s)
+    {
+      if (c == '"' || c == '\\')
+	result += std::string ("\\") + c;
+      else if ((unsigned char) c < 0x20)
+	{
+	  char escape[8];
+	  std::snprintf (escape, sizeof escape, "\\u%04x", c);
+	  result += escape;
+	}
+      else
+	result += c;
+    }
+  return result + '"';
+}
+
+static void
+format_text (std::string &out, const diagnostic &d)
 {
   if (tty)
-    std::cerr << "\033[35;1mwarning:\033[37m ";
-  else
-    std::cerr << "warning: ";
-  std::cerr << zcpp::filestack.top ()->filename << ':'
-	    << zcpp::filestack.top ()->line << ':';
-  if (tty)
-    std::cerr << "\033[0m ";
+    out += d.is_error ? "\033[31;1merror:\033[37m "
+      : "\033[35;1mwarning:\033[37m ";
   else
-    std::cerr << ' ';
-  std::cerr << msg << std::endl;
+    out += d.is_error ? "error: " : "warning: ";
+  out += d.filename + ':' + std::to_string (d.line) + ':';
+  out += tty ? "\033[0m " : " ";
+  out += d.msg + '\n';
 }
 
+static void
+format_json (std::string &out, const diagnostic &d)
+{
+  out += "{\"severity\":";
+  out += d.is_error ? "\"error\"" : "\"warning\"";
+  out += ",\"file\":" + json_string (d.filename) + ",\"line\":" +
+    std::to_string (d.line) + ",\"kind\":" + json_string (d.kind) +
+    ",\"message\":" + json_string (d.msg) + "}\n";
+}
+
+/* Writes every message kept so far in one piece, or drops them once
+   silenced, and forgets which ones have been seen */
+
 void
-zcpp::error (std::string msg)
+zcpp::flush_diagnostics (void)
 {
-  if (tty)
-    std::cerr << "\033[31;1merror:\033[37m ";
-  else
-    std::cerr << "error: ";
-  std::cerr << zcpp::filestack.top ()->filename << ':'
-	    << zcpp::filestack.top ()->line << ':';
-  if (tty)
-    std::cerr << "\033[0m ";
-  else
-    std::cerr << ' ';
-  std::cerr << msg << std::endl;
+  std::lock_guard <std::mutex> guard (diags.lock);
+  if (silenced)
+    {
+      diags.pending.clear ();
+      diags.seen.clear ();
+      diags.counts.clear ();
+      return;
+    }
+  std::string out;
+  for (const diagnostic &d : diags.pending)
+    {
+      if (zcpp::json_diagnostics)
+	format_json (out, d);
+      else
+	format_text (out, d);
+    }
+  for (const std::pair <const std::pair <bool, std::string>, unsigned long>
+	 &count : diags.counts)
+    {
+      if (zcpp::max_messages == 0 || count.second <= zcpp::max_messages)
+	continue;
+      unsigned long hidden = count.second - zcpp::max_messages;
+      const char *severity = count.first.first ? "error" : "warning";
+      if (zcpp::json_diagnostics)
+	out += std::string ("{\"severity\":\"note\",\"kind\":") +
+	  json_string (count.first.second) + ",\"hidden\":" +
+	  std::to_string (hidden) + ",\"of\":\"" + severity + "\"}\n";
+      else
+	out += "note: " + std::to_string (hidden) + " more " + severity +
+	  (hidden == 1 ? "" : "s") + " like \"" + count.first.second +
+	  "\" not shown\n";
+    }
+  diags.pending.clear ();
+  diags.seen.clear ();
+  diags.counts.clear ();
+  if (!out.empty ())
+    {
+      std::cerr.write (out.data (), out.size ());
+      std::cerr.flush ();
+    }
+}
+
+/* Used by a forked process, which must not write the messages it shares
+   with its parent or any of its own */
+
+void
+zcpp::silence_diagnostics (void)
+{
+  std::lock_guard <std::mutex> guard (diags.lock);
+  silenced = true;
+}
+
+unsigned long
+zcpp::diagnostics_reported (void)
+{
+  std::lock_guard <std::mutex> guard (diags.lock);
+  return reported;
+}
+
+/* Adds every message reported from now on to kept, until it is called
+   again with nullptr */
+
+void
+zcpp::keep_messages (std::vector <zcpp::message> *kept_messages)
+{
+  std::lock_guard <std::mutex> guard (diags.lock);
+  kept = kept_messages;
+}
+
+void
+zcpp::report_again (const zcpp::message &m)
+{
+  report (m.is_error, m.filename, m.line, m.text);
+  if (m.is_error)
+    zcpp::exiting = true;
+}
+
+void
+zcpp::warning (const zcpp::translation_unit &unit, std::string msg)
+{
+  ZCPP_PROBE (diagnostic, 0, unit.filename.c_str (), unit.line, msg.c_str ());
+  report (false, unit.filename, unit.line, std::move (msg));
+}
+
+void
+zcpp::warning (std::string msg)
+{
+  zcpp::warning (*zcpp::filestack.top (), std::move (msg));
+}
+
+void
+zcpp::error (const zcpp::translation_unit &unit, std::string msg)
+{
+  ZCPP_PROBE (diagnostic, 1, unit.filename.c_str (), unit.line, msg.c_str ());
+  report (true, unit.filename, unit.line, std::move (msg));
   zcpp::exiting = true;
 }
+
+void
+zcpp::error (std::string msg)
+{
+  zcpp::error (*zcpp::filestack.top (), std::move (msg));
+}
+
+[[noreturn]] void
+zcpp::fatal (std::string msg)
+{
+  zcpp::error (std::move (msg));
+  throw zcpp::fatal_error ();
+}
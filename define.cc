@@ -17,9 +17,12 @@
  *************************************************************************/
 
 #include <algorithm>
+#include <unordered_map>
 #include "zcpp.hh"
 
-std::map <std::string, std::unique_ptr <zcpp::macro>> zcpp::defines;
+zcpp::macro_table zcpp::defines;
+
+static unsigned long next_serial;
 
 static void
 check_valid_identifier (std::vector <std::string> &args, std::string &value)
@@ -40,42 +43,74 @@ check_valid_identifier (std::vector <std::string> &args, std::string &value)
   args.push_back (value);
 }
 
-zcpp::macro::macro (std::string value)
+zcpp::macro::macro (std::string_view value) : serial (++next_serial)
 {
   func = false;
   sub.push_back (zcpp::expand (value));
 }
 
-zcpp::macro::macro (std::vector <std::string> args, std::string value) :
-  args (args)
+zcpp::macro::macro (std::vector <std::string> args, std::string_view value) :
+  args (args), serial (++next_serial)
 {
   func = true;
-  value = zcpp::expand (value, &args);
+  zcpp::name_set names (args.begin (), args.end ());
+  split (zcpp::expand (value, &names));
+}
+
+zcpp::macro::macro (bool func, std::vector <std::string> args,
+		    std::string_view body) :
+  args (args), func (func), serial (++next_serial)
+{
+  if (func)
+    split (body);
+  else
+    sub.emplace_back (body);
+}
+
+/* Splits the body of a function-like macro into its parameters and the
+   text between them */
+
+void
+zcpp::macro::split (std::string_view body)
+{
+  /* Use the last parameter of the same name, like a map would */
+  std::unordered_map <std::string_view, std::size_t> index;
+  for (std::size_t j = 0; j < args.size (); j++)
+    index[args[j]] = j + 1;
+
   std::size_t i = 0;
-  while (i < value.size ())
+  while (i < body.size ())
     {
       std::string temp;
-      if (isalpha (value[i]) || value[i] == '_')
-        zcpp::expect_read_identifier (temp, value, i);
+      std::size_t param = 0;
+      if (isalpha (body[i]) || body[i] == '_')
+	{
+	  zcpp::expect_read_identifier (temp, body, i);
+	  std::unordered_map <std::string_view, std::size_t>::iterator it =
+	    index.find (temp);
+	  if (it != index.end ())
+	    param = it->second;
+	}
       else
 	{
-	  while (i < value.size () && !isalpha (value[i]) && value[i] != '_')
-	    temp += value[i++];
+	  std::size_t start = i;
+	  while (i < body.size () && !isalpha (body[i]) && body[i] != '_')
+	    i++;
+	  temp.assign (body, start, i - start);
 	}
       sub.push_back (temp);
+      params.push_back (param);
     }
 }
 
 void
-zcpp::define (std::string name, std::string value)
+zcpp::define (std::string_view name, std::string_view value)
 {
-  std::string realname;
-  std::size_t i;
-  for (i = 0; i < name.size () && name[i] != ' '; i++)
-    realname += name[i];
+  std::size_t i = std::min (name.find (' '), name.size ());
+  std::string_view realname = name.substr (0, i);
 
-  std::unique_ptr <zcpp::macro> macro;
-  if (name[i] == ' ')
+  std::shared_ptr <zcpp::macro> macro;
+  if (i < name.size ())
     {
       i++;
       std::vector <std::string> args;
@@ -100,114 +135,152 @@ zcpp::define (std::string name, std::string value)
       check_valid_identifier (args, temp);
       if (zcpp::exiting)
 	return;
-      macro = std::make_unique <zcpp::macro> (args, value);
+      macro = std::make_shared <zcpp::macro> (args, value);
     }
   else
-    macro = std::make_unique <zcpp::macro> (value);
+    macro = std::make_shared <zcpp::macro> (value);
 
-  if (zcpp::defines.find (realname) != zcpp::defines.end ())
-    warning ("redefining macro: " + realname);
-  zcpp::defines[realname] = std::move (macro);
+  ZCPP_PROBE (macro__define, realname.data (), realname.size (), macro->func);
+  if (zcpp::recording_region)
+    zcpp::record_write (realname, macro);
+  if (zcpp::defines.set (realname, std::move (macro)))
+    warning ("redefining macro: " + std::string (realname));
 }
 
-std::string
-zcpp::expand (const std::string &s, std::vector <std::string> *reserved)
+bool
+zcpp::is_defined (std::string_view name)
 {
-  std::string result;
+  /* Allow checking for support with #ifdef */
+  if (name == "__has_include" || name == "__has_include_next")
+    return true;
+  return zcpp::lookup (name) != nullptr;
+}
+
+/* Finds the definition of a macro whose value affects the output */
+
+const std::shared_ptr <zcpp::macro> *
+zcpp::lookup (std::string_view name)
+{
+  std::uint64_t hash = zcpp::name_hash (name);
+
+  /* A region has to know every name it read, including ones that could
+     be macros in another configuration */
+  if (zcpp::recording_region)
+    {
+      const std::shared_ptr <zcpp::macro> *macro =
+	zcpp::defines.find (name, hash);
+      zcpp::record_read (name, macro);
+      return macro;
+    }
+  if (!zcpp::maybe_macro (hash))
+    return nullptr;
+  return zcpp::defines.find (name, hash);
+}
+
+/* Appends the expansion of s to result. Only identifiers that name a
+   macro and the substituted text are copied piecewise; everything else
+   is appended in runs straight from s. */
+
+void
+zcpp::expand (std::string &result, std::string_view s,
+	      const zcpp::name_set *reserved)
+{
+  std::size_t base = result.size ();
   std::size_t i = 0;
+  std::size_t plain = 0; /* Start of text not yet appended */
   while (i < s.size ())
     {
-      if (isalpha (s[i]) || s[i] == '_')
+      if (!isalpha (s[i]) && s[i] != '_')
 	{
-	  std::string name;
-	  zcpp::expect_read_identifier (name, s, i);
-	  if ((reserved == nullptr
-	       || std::find (reserved->begin (),
-			     reserved->end (), name) == reserved->end ())
-	      && zcpp::defines.find (name) != zcpp::defines.end ())
+	  i++;
+	  continue;
+	}
+
+      std::size_t start = i;
+      while (i < s.size () && (std::isalnum (s[i]) || s[i] == '_'))
+	i++;
+      std::string_view name = s.substr (start, i - start);
+      if (reserved != nullptr && reserved->find (name) != reserved->end ())
+	continue;
+      const std::shared_ptr <zcpp::macro> *found = zcpp::lookup (name);
+      if (found == nullptr)
+	continue;
+
+      const std::shared_ptr <zcpp::macro> &macro = *found;
+      if (!macro->func)
+	{
+	  result.append (s, plain, start - plain);
+	  result += macro->sub[0];
+	  plain = i;
+	  if (result.size () - base > i + zcpp::max_expansion)
+	    zcpp::expansion_too_long ();
+	  continue;
+	}
+
+      while (i < s.size () && std::isspace (s[i]))
+	i++;
+      if (i >= s.size () || s[i] != '(')
+	continue;
+      ZCPP_PROBE (expand__begin, name.data (), name.size ());
+      std::vector <std::string_view> args;
+      std::size_t nested_parens = 1;
+      std::size_t arg = ++i;
+      for (; i < s.size () && nested_parens > 0; i++)
+	{
+	  if (s[i] == '(')
+	    nested_parens++;
+	  else if (s[i] == ')')
+	    nested_parens--;
+
+	  if (s[i] == ',' && nested_parens == 1)
 	    {
-	      const std::unique_ptr <zcpp::macro> &macro =
-		zcpp::defines[name];
-	      if (macro->func)
-	        {
-		  std::string temp;
-		  while (i < s.size () && std::isspace (s[i]))
-		    temp += s[i++];
-		  if (i >= s.size () || s[i] != '(')
-		    result += name + temp;
-		  else
-		    {
-		      std::vector <std::string> args;
-		      std::size_t nested_parens = 1;
-		      std::string arg;
-		      i++;
-		      while (nested_parens > 0)
-			{
-			  if (s[i] == '(')
-			    nested_parens++;
-			  else if (s[i] == ')')
-			    nested_parens--;
-
-			  if (s[i] == ',' && nested_parens == 1)
-			    {
-			      args.push_back (arg);
-			      arg.clear ();
-			    }
-			  else
-			    arg += s[i];
-			  if (++i >= s.size () && nested_parens > 0)
-			    {
-			      zcpp::error ("unmatched parenthesis in "
-					   "argument list");
-			      return std::string ();
-			    }
-			}
-		      args.push_back (arg);
-		      if (args.size () != macro->args.size ())
-			{
-			  zcpp::error ("passing " +
-				       std::to_string (args.size ()) +
-				       " arguments to macro " +
-				       zcpp::bold (name) + " which takes " +
-				       std::to_string (macro->args.size ()) +
-				       " arguments");
-			  return std::string ();
-			}
-
-		      std::map <std::string, std::string> map_sub;
-		      for (std::size_t j = 0; j < args.size (); j++)
-			map_sub[macro->args[j]] = args[j];
-
-		      for (const std::string &text : macro->sub)
-			{
-			  bool matched = false;
-			  if (!text.empty ()
-			      && (std::isalpha (text[0]) || text[0] == '_'))
-			    {
-			      for (const std::string &param : macro->args)
-				{
-				  if (text == param)
-				    {
-				      result += map_sub[text];
-				      matched = true;
-				      break;
-				    }
-				}
-			      if (matched)
-				continue;
-			    }
-			  result += text;
-			}
-		    }
-		}
-	      else
-	        result += macro->sub[0];
+	      args.push_back (s.substr (arg, i - arg));
+	      arg = i + 1;
 	    }
+	}
+      if (nested_parens > 0)
+	{
+	  zcpp::error ("unmatched parenthesis in argument list");
+	  result.resize (base);
+	  ZCPP_PROBE (expand__end, name.data (), name.size (), args.size (),
+		      0);
+	  return;
+	}
+      args.push_back (s.substr (arg, i - arg));
+      if (args.size () != macro->args.size ())
+	{
+	  zcpp::error ("passing " + std::to_string (args.size ()) +
+		       " arguments to macro " + zcpp::bold (std::string (name)) +
+		       " which takes " + std::to_string (macro->args.size ()) +
+		       " arguments");
+	  result.resize (base);
+	  ZCPP_PROBE (expand__end, name.data (), name.size (), args.size (),
+		      0);
+	  return;
+	}
+
+      result.append (s, plain, start - plain);
+      [[maybe_unused]] std::size_t length = result.size ();
+      for (std::size_t j = 0; j < macro->sub.size (); j++)
+	{
+	  if (macro->params[j] > 0)
+	    result += args[macro->params[j] - 1];
 	  else
-	    result += name;
+	    result += macro->sub[j];
 	}
-      else
-        result += s[i++];
+      ZCPP_PROBE (expand__end, name.data (), name.size (), args.size (),
+		  result.size () - length);
+      plain = i;
+      if (result.size () - base > i + zcpp::max_expansion)
+	zcpp::expansion_too_long ();
     }
+  result.append (s, plain, std::string_view::npos);
+}
+
+std::string
+zcpp::expand (std::string_view s, const zcpp::name_set *reserved)
+{
+  std::string result;
+  zcpp::expand (result, s, reserved);
   return result;
 }
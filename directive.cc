@@ -16,8 +16,11 @@
  * along with this program. If not, see <https://www.gnu.org/licenses/>. *
  *************************************************************************/
 
+#include <algorithm>
+#include <climits>
 #include <cstring>
-#include <fstream>
+#include <sstream>
+#include <unordered_map>
 #include "if-parser.hh"
 #include "zcpp.hh"
 
@@ -26,17 +29,28 @@
 extern FILE *yyin;
 extern bool if_result;
 
+class if_cache_entry
+{
+public:
+  std::vector <std::pair <std::string, unsigned long>> deps;
+  bool result;
+};
+
+unsigned long zcpp::if_cache_hits;
+unsigned long zcpp::if_cache_lookups;
+
 static std::stack <bool> ifstack;
 static std::stack <bool> elifstack;
+static std::size_t ifbase; /* Depth of ifstack when the current file began */
 static std::string ifdef_names[] = {"#ifndef", "#ifdef"};
+static std::unordered_map <std::string, if_cache_entry> if_cache;
 
 #include <iostream>
 
-static std::vector <std::string> *
-search_defined_calls (const std::string &s)
+static zcpp::name_set
+search_defined_calls (std::string_view s)
 {
-  std::vector <std::string> *reserved =
-    new std::vector <std::string> {"defined"};
+  zcpp::name_set reserved {"defined"};
   std::size_t pos = s.find ("defined", 0);
   while (pos != std::string::npos)
     {
@@ -56,14 +70,214 @@ search_defined_calls (const std::string &s)
 
       std::string temp;
       if (zcpp::expect_read_identifier (temp, s, pos, false, false, false))
-	reserved->push_back (temp);
+	reserved.insert (std::move (temp));
       pos = s.find ("defined", pos + 1);
     }
   return reserved;
 }
 
+static unsigned long
+macro_serial (const std::string &name)
+{
+  const std::shared_ptr <zcpp::macro> *macro = zcpp::lookup (name);
+  return macro == nullptr ? 0 : (*macro)->serial;
+}
+
+/* Macro bodies are expanded when they are defined, so the value of an
+   expression only depends on the macros named directly in it */
+
+static std::vector <std::pair <std::string, unsigned long>>
+if_dependencies (std::string_view s)
+{
+  std::vector <std::pair <std::string, unsigned long>> deps;
+  std::size_t i = 0;
+  while (i < s.size ())
+    {
+      if (std::isdigit (s[i]))
+	{
+	  while (i < s.size () && (std::isalnum (s[i]) || s[i] == '_'))
+	    i++;
+	}
+      else if (std::isalpha (s[i]) || s[i] == '_')
+	{
+	  std::string name;
+	  zcpp::expect_read_identifier (name, s, i);
+	  deps.emplace_back (name, macro_serial (name));
+	}
+      else
+	i++;
+    }
+  return deps;
+}
+
+/* Finds the end of a header name starting at pos, or returns npos and
+   reports an error */
+
+static std::size_t
+header_name_end (std::string_view s, std::size_t pos, const char *directive)
+{
+  if (pos >= s.size () || (s[pos] != '<' && s[pos] != '"'))
+    {
+      zcpp::error ("expected " + zcpp::bold ("<filename>") + " or " +
+		   zcpp::bold ("\"filename\"") + " after " + directive);
+      return std::string_view::npos;
+    }
+  char end = s[pos] == '<' ? '>' : '"';
+  std::size_t i = s.find (end, pos + 1);
+  if (i == std::string_view::npos)
+    {
+      zcpp::error (std::string (directive) + " missing terminating " +
+		   zcpp::bold (std::string (1, end)) + " character");
+      return std::string_view::npos;
+    }
+  return i + 1;
+}
+
+/* First include directory to search for #include_next and
+   __has_include_next */
+
+static std::size_t
+next_include_dir (const char *directive)
+{
+  std::size_t dir = zcpp::filestack.top ()->dir;
+  if (dir != std::string::npos)
+    return dir + 1;
+  zcpp::warning (std::string (directive) + " in primary source file");
+  return 0;
+}
+
+/* Replaces __has_include and __has_include_next expressions with their
+   values, since header names must not be macro expanded */
+
+static std::string
+replace_has_include (std::string_view s)
+{
+  std::string result;
+  std::size_t plain = 0;
+  std::size_t pos = 0;
+  while ((pos = s.find ("__has_include", pos)) != std::string_view::npos)
+    {
+      std::size_t start = pos;
+      pos += 13;
+      bool is_next = s.compare (pos, 5, "_next") == 0;
+      if (is_next)
+	pos += 5;
+      if ((start > 0 && (std::isalnum (s[start - 1]) || s[start - 1] == '_'))
+	  || (pos < s.size () && (std::isalnum (s[pos]) || s[pos] == '_')))
+	continue;
+
+      /* Leave the operand of defined alone */
+      std::size_t i = start;
+      while (i > 0 && (std::isspace (s[i - 1]) || s[i - 1] == '('))
+	i--;
+      if (i >= 7 && s.compare (i - 7, 7, "defined") == 0)
+	continue;
+
+      const char *name = is_next ? "__has_include_next" : "__has_include";
+      while (pos < s.size () && std::isspace (s[pos]))
+	pos++;
+      if (pos >= s.size () || s[pos] != '(')
+	{
+	  zcpp::error ("missing " + zcpp::bold ("(") + " after " +
+		       zcpp::bold (name));
+	  return result;
+	}
+      pos++;
+      while (pos < s.size () && std::isspace (s[pos]))
+	pos++;
+      std::size_t end = header_name_end (s, pos, name);
+      if (end == std::string_view::npos)
+	return result;
+      std::string spec (s.substr (pos, end - pos));
+      pos = end;
+      while (pos < s.size () && std::isspace (s[pos]))
+	pos++;
+      if (pos >= s.size () || s[pos] != ')')
+	{
+	  zcpp::error ("missing " + zcpp::bold (")") + " after " +
+		       zcpp::bold (name) + " operand");
+	  return result;
+	}
+      pos++;
+
+      std::string filename;
+      std::size_t dir = zcpp::find_include (spec, is_next
+					    ? next_include_dir (name) : 0,
+					    filename);
+      result.append (s, plain, start - plain);
+      result += dir == std::string::npos ? " 0 " : " 1 ";
+      plain = pos;
+    }
+  result.append (s, plain, std::string_view::npos);
+  return result;
+}
+
+static bool
+evaluate_if (std::string_view content, bool &result)
+{
+  std::string replaced;
+  if (content.find ("__has_include") != std::string_view::npos)
+    {
+      replaced = replace_has_include (content);
+      if (zcpp::exiting)
+	return false;
+      content = replaced;
+    }
+
+  zcpp::if_cache_lookups++;
+  std::string key (content);
+  std::unordered_map <std::string, if_cache_entry>::iterator it =
+    if_cache.find (key);
+  if (it != if_cache.end ())
+    {
+      bool valid = true;
+      for (const std::pair <std::string, unsigned long> &dep :
+	     it->second.deps)
+	{
+	  if (macro_serial (dep.first) != dep.second)
+	    {
+	      valid = false;
+	      break;
+	    }
+	}
+      if (valid)
+	{
+	  zcpp::if_cache_hits++;
+	  result = it->second.result;
+	  ZCPP_PROBE (if__eval, content.data (), content.size (), result, 1);
+	  return true;
+	}
+    }
+
+  zcpp::name_set reserved = search_defined_calls (content);
+  std::string s (zcpp::expand (content, &reserved));
+  if (zcpp::exiting)
+    return false;
+  void *buffer = malloc (s.size ());
+  memcpy (buffer, s.c_str (), s.size ());
+  yyin = fmemopen (buffer, s.size (), "r");
+  if (yyin == nullptr)
+    {
+      zcpp::error ("failed to open memory stream");
+      free (buffer);
+      return false;
+    }
+  int ret = yyparse ();
+  fclose (yyin);
+  free (buffer);
+  if (ret != 0)
+    return false;
+
+  result = if_result;
+  ZCPP_PROBE (if__eval, content.data (), content.size (), result, 0);
+  if_cache_entry &entry = if_cache[key];
+  entry.deps = if_dependencies (content);
+  entry.result = result;
+  return true;
+}
+
 static void
-parse_define (const std::string &content)
+parse_define (std::string_view content)
 {
   std::string name;
   std::size_t i = 0;
@@ -85,14 +299,14 @@ parse_define (const std::string &content)
     {
       i++;
       name += ' ';
-      while (i < content.size () && content[i] != ')')
-	name += content[i++];
-      if (content[i] != ')')
+      std::size_t close = content.find (')', i);
+      if (close == std::string_view::npos)
 	{
 	  zcpp::error ("unterminated function macro parameter list");
 	  return;
 	}
-      i++;
+      name += content.substr (i, close - i);
+      i = close + 1;
     }
   if (i < content.size () && !std::isspace (content[i]))
     {
@@ -105,14 +319,14 @@ parse_define (const std::string &content)
 }
 
 static void
-parse_elif (const std::string &content)
+parse_elif (std::string_view content)
 {
   if (content.empty ())
     {
       zcpp::error ("expected expression after #elif directive");
       return;
     }
-  if (ifstack.size () <= 1)
+  if (ifstack.size () <= ifbase + 1)
     {
       zcpp::error ("unmatched #elif directive");
       return;
@@ -123,41 +337,30 @@ parse_elif (const std::string &content)
       return;
     }
 
-  std::vector <std::string> *reserved = search_defined_calls (content);
-  std::string s (zcpp::expand (content, reserved));
-  delete reserved;
-  void *buffer = malloc (s.size ());
-  memcpy (buffer, s.c_str (), s.size ());
-  yyin = fmemopen (buffer, s.size (), "r");
-  if (yyin == nullptr)
-    {
-      zcpp::error ("failed to open memory stream");
-      return;
-    }
-  if (yyparse () != 0)
+  bool result;
+  if (!evaluate_if (content, result))
     return;
-  free (buffer);
-  ifstack.top () = if_result;
-  elifstack.top () = if_result;
+  ifstack.top () = result;
+  elifstack.top () = result;
 }
 
 static void
-parse_else (const std::string &content)
+parse_else (std::string_view content)
 {
   if (!content.empty ())
     zcpp::warning ("ignoring extra tokens at end of #else directive");
-  if (ifstack.size () > 1)
+  if (ifstack.size () > ifbase + 1)
     ifstack.top () = !elifstack.top ();
   else
     zcpp::error ("unmatched #else directive");
 }
 
 static void
-parse_endif (const std::string &content)
+parse_endif (std::string_view content)
 {
   if (!content.empty ())
     zcpp::warning ("ignoring extra tokens at end of #endif directive");
-  if (ifstack.size () > 1)
+  if (ifstack.size () > ifbase + 1)
     {
       ifstack.pop ();
       elifstack.pop ();
@@ -167,7 +370,7 @@ parse_endif (const std::string &content)
 }
 
 static void
-parse_if (const std::string &content)
+parse_if (std::string_view content)
 {
   if (content.empty ())
     {
@@ -184,31 +387,16 @@ parse_if (const std::string &content)
     }
   else
     {
-      std::vector <std::string> *reserved = search_defined_calls (content);
-      std::string s (zcpp::expand (content, reserved));
-      delete reserved;
-      void *buffer = malloc (s.size ());
-      memcpy (buffer, s.c_str (), s.size ());
-      yyin = fmemopen (buffer, s.size (), "r");
-      if (yyin == nullptr)
-	{
-	  zcpp::error ("failed to open memory stream");
-	  return;
-	}
-      if (yyparse () != 0)
-	{
-	  ifstack.push (false);
-	  elifstack.push (false);
-	  return;
-	}
-      free (buffer);
-      ifstack.push (if_result);
-      elifstack.push (if_result);
+      bool result;
+      if (!evaluate_if (content, result))
+	result = false;
+      ifstack.push (result);
+      elifstack.push (result);
     }
 }
 
 static void
-parse_ifdef (bool truth, const std::string &content)
+parse_ifdef (bool truth, std::string_view content)
 {
   std::string name;
   std::size_t i = 0;
@@ -222,59 +410,115 @@ parse_ifdef (bool truth, const std::string &content)
   if (i < content.size ())
     zcpp::warning (std::string ("ignoring extra tokens at end of ") +
 		   ifdef_names[(int) truth] + " directive");
-  bool result = truth == (zcpp::defines.find (name) != zcpp::defines.end ());
+  bool result = truth == zcpp::is_defined (name);
   ifstack.push (result);
   elifstack.push (result);
 }
 
 static void
-parse_include (std::string &result, const std::string &content)
+include_file (std::string &result, const std::string &filename,
+	      std::size_t dir, std::istream &file)
 {
-  if (content.empty () || (content[0] != '<' && content[0] != '"'))
+  std::size_t length = result.size ();
+  if (!zcpp::replay_region (result, filename))
     {
-      zcpp::error ("expected " + zcpp::bold ("<filename>") + " or " +
-		   zcpp::bold ("\"filename\"") + " after #include directive");
-      return;
+      bool recording = zcpp::begin_region (filename);
+      zcpp::preprocess (result, filename, file, dir);
+      if (recording)
+	zcpp::end_region (filename,
+			  std::string_view (result).substr (length));
     }
-  char end = content[0] == '<' ? '>' : '"';
-
-  std::size_t i;
-  std::string path;
-  for (i = 1; i < content.size () && content[i] != end; i++)
-    path += content[i];
-  if (i++ >= content.size ())
+  if (zcpp::exiting)
     {
-      zcpp::error ("#include directive missing terminating " +
-		   zcpp::bold (std::string (end, 1)) + " character");
+      result.resize (length);
       return;
     }
+  result += zcpp::stamp_file ();
+}
 
+static void
+parse_include (std::string &result, std::string_view content, bool next)
+{
+  const char *directive = next ? "#include_next directive"
+    : "#include directive";
+  if (!ifstack.top ())
+    return;
+  std::size_t i = header_name_end (content, 0, directive);
+  if (i == std::string_view::npos)
+    return;
+  std::string spec (content.substr (0, i));
   while (i < content.size () && std::isspace (content[i]))
     i++;
   if (i < content.size ())
-    zcpp::warning ("ignoring extra tokens at end of #include directive");
+    zcpp::warning (std::string ("ignoring extra tokens at end of ") +
+		   directive);
 
-  for (const zcpp::include &dir : zcpp::includes)
+  std::string filename;
+  std::size_t dir;
+  std::string contents;
+  ZCPP_PROBE (include__lookup, spec.c_str (), next);
+  bool prefetched = !next && zcpp::take_prefetched (spec, filename, dir,
+						    contents);
+  if (!prefetched)
+    dir = zcpp::find_include (spec, next ? next_include_dir (directive) : 0,
+			      filename);
+  else
+    zcpp::cache_search (spec, 0, filename);
+  ZCPP_PROBE (include__result, spec.c_str (),
+	      dir == std::string::npos ? nullptr : filename.c_str ());
+  if (!prefetched)
     {
-      if (end == '>' && dir.type == zcpp::include::quote)
-	continue;
-      std::string filename = dir.path + '/' + path;
-      std::ifstream file (filename);
-      if (!file.good ())
-	continue;
-      std::string output = zcpp::preprocess (filename, file);
-      if (zcpp::exiting)
-	return;
-      result += output;
-      result += zcpp::stamp_file ();
+      if (dir == std::string::npos)
+	{
+	  zcpp::error ("failed to find " +
+		       zcpp::bold (spec.substr (1, spec.size () - 2)) + ": " +
+		       std::strerror (ENOENT));
+	  return;
+	}
+      std::unique_ptr <std::istream> file = zcpp::files->open (filename);
+      if (file == nullptr)
+	{
+	  zcpp::error ("failed to open " + zcpp::bold (filename) + ": " +
+		       std::strerror (errno));
+	  return;
+	}
+      if (zcpp::cache_dir.empty ())
+	{
+	  include_file (result, filename, dir, *file);
+	  return;
+	}
+      std::ostringstream stream;
+      stream << file->rdbuf ();
+      contents = stream.str ();
+    }
+
+  zcpp::cache_include (filename, contents);
+  std::istringstream file (contents);
+  include_file (result, filename, dir, file);
+}
+
+static void
+parse_embed (std::string &result, std::string_view content)
+{
+  if (!ifstack.top ())
+    return;
+  std::size_t i = header_name_end (content, 0, "#embed directive");
+  if (i == std::string_view::npos)
+    return;
+  std::string spec (content.substr (0, i));
+  std::string filename;
+  if (zcpp::find_include (spec, 0, filename) == std::string::npos)
+    {
+      zcpp::error ("failed to find " +
+		   zcpp::bold (spec.substr (1, spec.size () - 2)) + ": " +
+		   std::strerror (ENOENT));
       return;
     }
-  zcpp::error ("failed to find " + zcpp::bold (path) + ": " +
-	       std::strerror (errno));
+  zcpp::embed (result, filename, content.substr (i));
 }
 
 static void
-parse_line (const std::string &content)
+parse_line (std::string_view content)
 {
   unsigned long line = 0;
   std::size_t i = 0;
@@ -310,7 +554,7 @@ parse_line (const std::string &content)
 }
 
 static void
-parse_undef (const std::string &content)
+parse_undef (std::string_view content)
 {
   std::string name;
   std::size_t i = 0;
@@ -323,6 +567,9 @@ parse_undef (const std::string &content)
     }
   zcpp::expect_read_identifier (name, content, i);
   zcpp::defines.erase (name);
+  ZCPP_PROBE (macro__undef, name.c_str ());
+  if (zcpp::recording_region)
+    zcpp::record_write (name, nullptr);
 
   while (i < content.size () && std::isspace (content[i]))
     i++;
@@ -332,7 +579,7 @@ parse_undef (const std::string &content)
 
 static void
 parse_directive (std::string &result, const std::string &name,
-		 const std::string &content)
+		 std::string_view content)
 {
   if (name == "define")
     parse_define (content);
@@ -340,16 +587,20 @@ parse_directive (std::string &result, const std::string &name,
     parse_elif (content);
   else if (name == "else")
     parse_else (content);
+  else if (name == "embed")
+    parse_embed (result, content);
   else if (name == "endif")
     parse_endif (content);
   else if (name == "error")
-    zcpp::error ("#error " + content);
+    zcpp::error ("#error " + std::string (content));
   else if (name == "if")
     parse_if (content);
   else if (name == "ifdef" || name == "ifndef")
     parse_ifdef (name == "ifdef", content);
   else if (name == "include")
-    parse_include (result, content);
+    parse_include (result, content, false);
+  else if (name == "include_next")
+    parse_include (result, content, true);
   else if (name == "line")
     parse_line (content);
   else if (name == "pragma")
@@ -357,18 +608,23 @@ parse_directive (std::string &result, const std::string &name,
   else if (name == "undef")
     parse_undef (content);
   else if (name == "warning")
-    zcpp::warning ("#warning " + content);
+    zcpp::warning ("#warning " + std::string (content));
   else
     {
       if (!ifstack.top ())
 	return;
-      unsigned long line;
+      unsigned long line = 0;
       for (char c : name)
 	{
 	  if (!std::isdigit (c))
 	    goto err;
+	  if (line > (ULONG_MAX - (c - '0')) / 10)
+	    {
+	      zcpp::error ("line number in # directive is too large");
+	      return;
+	    }
+	  line = line * 10 + (c - '0');
 	}
-      line = std::stoul (name);
       if (content.empty ())
 	{
 	  zcpp::change_line (line, nullptr);
@@ -390,32 +646,45 @@ parse_directive (std::string &result, const std::string &name,
     }
 }
 
-std::string
-zcpp::parse_directives (void)
+static void
+save_checkpoint (std::size_t pos, std::size_t length)
+{
+  zcpp::checkpoints.emplace_back ();
+  zcpp::checkpoint &cp = zcpp::checkpoints.back ();
+  cp.pos = pos;
+  cp.length = length;
+  cp.line = zcpp::filestack.top ()->line;
+  cp.filename = zcpp::filestack.top ()->filename;
+  cp.defines = zcpp::defines;
+  cp.ifstack = ifstack;
+  cp.elifstack = elifstack;
+}
+
+static void
+run_directives (std::string &result, std::size_t start)
 {
-  std::string result;
   int last = '\n'; /* Begin accepting directives */
-  zcpp::filestack.top ()->line = 0; /* Reset line numbering */
-  ifstack.push (true);
-  for (std::size_t pos = 0; pos < input.size (); pos++)
+  for (std::size_t pos = start; pos < input.size (); pos++)
     {
       if (last == '\n' && input[pos] == '#')
 	{
+	  std::size_t begin = pos;
 	  std::string name;
 	  do
 	    pos++;
-	  while (std::isspace (input[pos]) && input[pos] != '\n');
-	  if (input[pos] == '\n') /* Null directive */
+	  while (pos < input.size () && std::isspace (input[pos])
+		 && input[pos] != '\n');
+	  if (pos == input.size () || input[pos] == '\n') /* Null directive */
 	    {
 	      result += '\n';
 	      goto end;
 	    }
-	  expect_read_identifier (name, input, pos, true);
+	  zcpp::expect_read_identifier (name, input, pos, true);
 	  if (pos < input.size ())
 	    {
 	      if (!std::isspace (input[pos]))
 		{
-		  error ("expected an identifier in directive name");
+		  zcpp::error ("expected an identifier in directive name");
 		  while (pos < input.size () && input[pos] != '\n')
 		    pos++;
 		  continue;
@@ -425,19 +694,45 @@ zcpp::parse_directives (void)
 		pos++;
 	    }
 
-	  std::string content;
-	  while (pos < input.size () && input[pos] != '\n')
-	    content += input[pos++];
+	  std::size_t start = pos;
+	  pos = std::min (input.find ('\n', pos), input.size ());
+	  std::string_view content (input.data () + start, pos - start);
 
-	  parse_directive (result, name, content);
+	  /* Only includes of the main file are restart points */
+	  if (zcpp::watching && name == "include" && ifstack.top ()
+	      && zcpp::filestack.size () == 2)
+	    save_checkpoint (begin, result.size ());
+	  if (zcpp::speculate_jobs > 0 && name == "include" && ifstack.top ()
+	      && zcpp::filestack.size () == 2)
+	    {
+	      if (!zcpp::splice_speculation (result, begin))
+		parse_directive (result, name, content);
+	      zcpp::speculate_includes (input, pos);
+	    }
+	  else if (zcpp::sharing_prefix && name == "include" && ifstack.top ()
+		   && zcpp::filestack.size () == 2)
+	    {
+	      if (!zcpp::splice_prefix (result, content))
+		{
+		  std::size_t length = result.size ();
+		  parse_directive (result, name, content);
+		  zcpp::record_prefix (result, length);
+		}
+	    }
+	  else
+	    parse_directive (result, name, content);
 	  result += '\n';
+	  zcpp::charge_line (1);
 	}
       else if (ifstack.top ())
 	{
-	  std::string temp;
-	  while (pos < input.size () && input[pos] != '\n')
-	    temp += input[pos++];
-	  result += zcpp::expand (temp) + '\n';
+	  std::size_t start = pos;
+	  std::size_t length = result.size ();
+	  pos = std::min (input.find ('\n', pos), input.size ());
+	  zcpp::expand (result,
+			std::string_view (input.data () + start, pos - start));
+	  result += '\n';
+	  zcpp::charge_line (result.size () - length);
 	}
 
     end:
@@ -446,7 +741,80 @@ zcpp::parse_directives (void)
       if (!std::isspace (input[pos]) || input[pos] == '\n')
 	last = input[pos];
     }
-  if (ifstack.size () > 1)
+}
+
+static void
+finish_directives (std::size_t outer_ifbase)
+{
+  if (ifstack.size () > ifbase + 1)
     zcpp::error ("unmatched #if, expected " + zcpp::bold ("#endif"));
+  while (ifstack.size () > ifbase + 1)
+    {
+      ifstack.pop ();
+      elifstack.pop ();
+    }
+  ifstack.pop ();
+  ifbase = outer_ifbase;
+}
+
+void
+zcpp::parse_directives (std::string &result)
+{
+  std::size_t outer_ifbase = ifbase;
+  zcpp::filestack.top ()->line = 0; /* Reset line numbering */
+  ifbase = ifstack.size ();
+  ifstack.push (true);
+  run_directives (result, 0);
+  finish_directives (outer_ifbase);
+}
+
+void
+zcpp::parse_directives (const std::function <bool (std::string &)> &next,
+			const std::function <void (std::string &)> &write)
+{
+  std::string result;
+  std::size_t outer_ifbase = ifbase;
+  zcpp::filestack.top ()->line = 0; /* Reset line numbering */
+  ifbase = ifstack.size ();
+  ifstack.push (true);
+  while (next (input))
+    {
+      run_directives (result, 0);
+      write (result);
+      result.clear ();
+    }
+  finish_directives (outer_ifbase);
+}
+
+std::string
+zcpp::resume_directives (const zcpp::checkpoint &from, std::string result)
+{
+  zcpp::filestack.top ()->line = from.line;
+  zcpp::filestack.top ()->filename = from.filename;
+  zcpp::defines = from.defines;
+  ifbase = 0;
+  ifstack = from.ifstack;
+  elifstack = from.elifstack;
+  run_directives (result, from.pos);
+  finish_directives (0);
   return result;
 }
+
+/* Forgets the conditionals of files abandoned after a fatal error */
+
+void
+zcpp::reset_directives (void)
+{
+  ifbase = 0;
+  ifstack = std::stack <bool> ();
+  elifstack = std::stack <bool> ();
+}
+
+/* Forgets the results of every #if, so that each input costs the same
+   however many were preprocessed before it */
+
+void
+zcpp::forget_conditions (void)
+{
+  if_cache.clear ();
+}
@@ -0,0 +1,307 @@
+/*************************************************************************
+ * embed.cc - This file is part of zcpp.                                 *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include "zcpp.hh"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class embed_params
+{
+public:
+  std::uintmax_t limit = UINTMAX_MAX;
+  std::string prefix;
+  std::string suffix;
+  std::string if_empty;
+};
+
+/* Each byte value followed by a comma, padded so that every value can be
+   written with one four-byte copy */
+
+class byte_table
+{
+public:
+  char text[256][4];
+  unsigned char length[256];
+
+  byte_table (void)
+  {
+    for (int i = 0; i < 256; i++)
+      {
+	std::string s = std::to_string (i) + ',';
+	std::memset (text[i], 0, 4);
+	std::memcpy (text[i], s.data (), s.size ());
+	length[i] = s.size ();
+      }
+  }
+};
+
+static const byte_table byte_texts;
+
+std::vector <std::unique_ptr <zcpp::embed_resource>> zcpp::embedded;
+
+zcpp::embed_resource::embed_resource (const std::string &filename,
+				      std::uintmax_t limit)
+  : good (false), map (nullptr), map_size (0)
+{
+  if (zcpp::files->view (filename, bytes))
+    {
+      bytes = bytes.substr (0, std::min ((std::uintmax_t) bytes.size (),
+					 limit));
+      good = true;
+      return;
+    }
+
+#ifdef HAVE_SYS_MMAN_H
+  int fd = open (filename.c_str (), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode))
+    {
+      std::size_t size = std::min ((std::uintmax_t) st.st_size, limit);
+      if (size == 0)
+	{
+	  close (fd);
+	  good = true;
+	  return;
+	}
+      void *p = mmap (nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED)
+	{
+	  close (fd);
+	  map = p;
+	  map_size = size;
+	  bytes = std::string_view ((const char *) p, size);
+	  good = true;
+	  return;
+	}
+    }
+  close (fd);
+#endif
+
+  /* Devices and pipes can't be mapped */
+  std::unique_ptr <std::istream> file = zcpp::files->open (filename);
+  if (file == nullptr)
+    return;
+  char buffer[65536];
+  while (copy.size () < limit)
+    {
+      file->read (buffer, std::min ((std::uintmax_t) sizeof buffer,
+				    limit - copy.size ()));
+      copy.append (buffer, file->gcount ());
+      if (file->gcount () == 0)
+	break;
+    }
+  if (file->bad ())
+    return;
+  bytes = copy;
+  good = true;
+}
+
+zcpp::embed_resource::~embed_resource (void)
+{
+#ifdef HAVE_SYS_MMAN_H
+  if (map != nullptr)
+    munmap (map, map_size);
+#endif
+}
+
+/* Returns the end of the parenthesized clause starting at pos, or npos
+   if it is not closed */
+
+static std::size_t
+clause_end (std::string_view s, std::size_t pos)
+{
+  int depth = 0;
+  for (std::size_t i = pos; i < s.size (); i++)
+    {
+      if (s[i] == '"' || s[i] == '\'')
+	{
+	  char quote = s[i++];
+	  while (i < s.size () && s[i] != quote)
+	    i += s[i] == '\\' ? 2 : 1;
+	  if (i >= s.size ())
+	    return std::string_view::npos;
+	}
+      else if (s[i] == '(')
+	depth++;
+      else if (s[i] == ')' && --depth == 0)
+	return i + 1;
+    }
+  return std::string_view::npos;
+}
+
+static bool
+parse_limit (std::string_view clause, std::uintmax_t &limit)
+{
+  std::string s = zcpp::expand (clause);
+  if (zcpp::exiting)
+    return false;
+  const char *begin = s.c_str ();
+  while (std::isspace (*begin))
+    begin++;
+  char *end;
+  errno = 0;
+  limit = std::strtoumax (begin, &end, 0);
+  while (*end == 'u' || *end == 'U' || *end == 'l' || *end == 'L')
+    end++;
+  while (std::isspace (*end))
+    end++;
+  if (end == begin || *end != '\0' || errno != 0)
+    {
+      zcpp::error ("expected an integer constant in " + zcpp::bold ("limit") +
+		   " parameter of #embed directive");
+      return false;
+    }
+  return true;
+}
+
+static bool
+parse_params (std::string_view s, embed_params &params)
+{
+  std::size_t i = 0;
+  while (true)
+    {
+      while (i < s.size () && std::isspace (s[i]))
+	i++;
+      if (i >= s.size ())
+	return true;
+
+      std::string name;
+      if (!zcpp::expect_read_identifier (name, s, i))
+	return false;
+      while (s.compare (i, 2, "::") == 0)
+	{
+	  name += "::";
+	  i += 2;
+	  if (!zcpp::expect_read_identifier (name, s, i))
+	    return false;
+	}
+      if (name.size () > 4 && name.compare (0, 2, "__") == 0
+	  && name.compare (name.size () - 2, 2, "__") == 0)
+	name = name.substr (2, name.size () - 4);
+
+      while (i < s.size () && std::isspace (s[i]))
+	i++;
+      if (i >= s.size () || s[i] != '(')
+	{
+	  zcpp::error ("missing " + zcpp::bold ("(") + " after " +
+		       zcpp::bold (name) + " parameter of #embed directive");
+	  return false;
+	}
+      std::size_t end = clause_end (s, i);
+      if (end == std::string_view::npos)
+	{
+	  zcpp::error ("missing " + zcpp::bold (")") + " after " +
+		       zcpp::bold (name) + " parameter of #embed directive");
+	  return false;
+	}
+      std::string_view clause = s.substr (i + 1, end - i - 2);
+      i = end;
+
+      if (name == "limit")
+	{
+	  if (!parse_limit (clause, params.limit))
+	    return false;
+	}
+      else if (name == "prefix")
+	params.prefix = zcpp::expand (clause);
+      else if (name == "suffix")
+	params.suffix = zcpp::expand (clause);
+      else if (name == "if_empty")
+	params.if_empty = zcpp::expand (clause);
+      else
+	{
+	  zcpp::error ("unsupported #embed parameter: " + zcpp::bold (name));
+	  return false;
+	}
+      if (zcpp::exiting)
+	return false;
+    }
+}
+
+/* Appends the bytes as a comma-separated list of integers */
+
+static void
+format_bytes (std::string &result, std::string_view bytes)
+{
+  std::size_t start = result.size ();
+  result.resize (start + bytes.size () * 4);
+  char *out = &result[start];
+  for (unsigned char c : bytes)
+    {
+      std::memcpy (out, byte_texts.text[c], 4);
+      out += byte_texts.length[c];
+    }
+  result.resize (out - result.data () - 1);
+}
+
+/* Appends the expansion of an #embed directive. When writing a token
+   stream the bytes are not formatted. The resource is kept in embedded
+   instead, and a marker line with its index is written, which
+   write_tokens turns into a single token holding the raw bytes. */
+
+void
+zcpp::embed (std::string &result, const std::string &filename,
+	     std::string_view params)
+{
+  embed_params p;
+  if (!parse_params (params, p))
+    return;
+  std::unique_ptr <zcpp::embed_resource> resource =
+    std::make_unique <zcpp::embed_resource> (filename, p.limit);
+  if (!resource->good)
+    {
+      zcpp::error ("failed to open " + zcpp::bold (filename) + ": " +
+		   std::strerror (errno));
+      return;
+    }
+  zcpp::cache_include (filename, resource->bytes);
+  if (zcpp::watching)
+    zcpp::watch_dependency (filename);
+
+  std::size_t length = result.size ();
+  if (resource->bytes.empty ())
+    result += p.if_empty;
+  else
+    {
+      if (!p.prefix.empty ())
+	result += p.prefix + ' ';
+      if (zcpp::emit_tokens)
+	{
+	  result += "\n#embed " + std::to_string (zcpp::embedded.size ()) +
+	    '\n';
+	  zcpp::embedded.push_back (std::move (resource));
+	}
+      else
+	format_bytes (result, resource->bytes);
+      if (!p.suffix.empty ())
+	result += ' ' + p.suffix;
+    }
+  zcpp::charge_line (result.size () - length);
+}
@@ -21,15 +21,6 @@
 
 std::stack <std::unique_ptr <zcpp::translation_unit>> zcpp::filestack;
 
-int
-zcpp::next_char (void)
-{
-  int c = zcpp::filestack.top ()->file.get ();
-  if (c == '\n')
-    zcpp::filestack.top ()->line++;
-  return c;
-}
-
 void
 zcpp::change_line (unsigned long line, std::string *filename)
 {
@@ -38,18 +29,66 @@ zcpp::change_line (unsigned long line, std::string *filename)
     zcpp::filestack.top ()->filename = std::string (*filename);
 }
 
-std::string
-zcpp::preprocess (std::string filename, std::istream &file)
+/* Appends the output of the file to result, so that the output of nested
+   includes is only ever copied once */
+
+void
+zcpp::preprocess (std::string &result, std::string filename,
+		  std::istream &file, std::size_t dir)
 {
+  zcpp::check_include_depth ();
+  if (zcpp::recording_region)
+    zcpp::record_depth (zcpp::filestack.size ());
+  ZCPP_PROBE (file__enter, filename.c_str (), zcpp::filestack.size ());
+  [[maybe_unused]] std::size_t length = result.size ();
   zcpp::filestack.push (std::make_unique <zcpp::translation_unit> (filename,
-								   file));
-  zcpp::filestack.top ()->output = zcpp::stamp_file ();
-  zcpp::filestack.top ()->output += zcpp::replace_comments_escapes ();
+								   file,
+								   dir));
+  std::string *cached = nullptr;
+  if (zcpp::watching)
+    cached = zcpp::watch_file (filename);
+  else if (!zcpp::configs.empty ())
+    cached = zcpp::config_file (filename);
+  if (cached != nullptr && !cached->empty ())
+    zcpp::filestack.top ()->output = *cached;
+  else
+    {
+      zcpp::filestack.top ()->output = zcpp::stamp_file ();
+      zcpp::filestack.top ()->output += zcpp::replace_comments_escapes ();
+      ZCPP_PROBE (file__read, filename.c_str (), zcpp::filestack.size () - 1,
+		  zcpp::filestack.top ()->output.size ());
+      zcpp::prefetch_includes (zcpp::filestack.top ()->output);
+      if (cached != nullptr && !zcpp::exiting)
+	*cached = zcpp::filestack.top ()->output;
+    }
 
-  std::string stage2 = zcpp::parse_directives ();
-  zcpp::filestack.top ()->output = std::string (stage2);
-
-  std::string result = zcpp::filestack.top ()->output;
+  zcpp::parse_directives (result);
+  if (zcpp::filestack.size () == 2)
+    zcpp::end_speculation ();
+  zcpp::drop_prefetched ();
+  ZCPP_PROBE (file__exit, filename.c_str (), zcpp::filestack.size () - 1,
+	      result.size () - length);
   zcpp::filestack.pop ();
+}
+
+std::string
+zcpp::preprocess (std::string filename, std::istream &file, std::size_t dir)
+{
+  std::string result;
+  zcpp::preprocess (result, std::move (filename), file, dir);
   return result;
 }
+
+/* Closes every file left open by a fatal error, leaving only the command
+   line, so that another file can be preprocessed */
+
+void
+zcpp::abandon_files (void)
+{
+  while (zcpp::filestack.size () > 1)
+    zcpp::filestack.pop ();
+  zcpp::drop_prefetched ();
+  zcpp::reset_directives ();
+  zcpp::drop_recordings ();
+  zcpp::end_speculation ();
+}
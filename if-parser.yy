@@ -130,12 +130,12 @@ number:		"number"
 defined_expression:
 		"defined" "identifier"
 		{
-		  $$ = zcpp::defines.find (*$2) != zcpp::defines.end ();
+		  $$ = zcpp::is_defined (*$2);
 		  delete $2;
 		}
 	|	"defined" "(" "identifier" ")"
 		{
-		  $$ = zcpp::defines.find (*$3) != zcpp::defines.end ();
+		  $$ = zcpp::is_defined (*$3);
 		  delete $3;
 		}
 	;
@@ -16,10 +16,16 @@
  * along with this program. If not, see <https://www.gnu.org/licenses/>. *
  *************************************************************************/
 
+#include <algorithm>
 #include "zcpp.hh"
 
 std::vector <zcpp::include> zcpp::includes;
 
+/* Results of searching for a header, keyed by the header name with its
+   delimiters and the index of the first directory searched */
+static std::map <std::pair <std::string, std::size_t>,
+		 std::pair <std::size_t, std::string>> lookups;
+
 const int zcpp::include::quote = 0;
 const int zcpp::include::regular = 1;
 const int zcpp::include::system = 2;
@@ -28,24 +34,101 @@ const int zcpp::include::dirafter = 3;
 void
 zcpp::add_includedir (std::string path, int type)
 {
-  if (!includes.empty ())
+  lookups.clear ();
+
+  /* The search path is kept sorted by type, and most directories go at
+     the end of it */
+  if (zcpp::includes.empty () || zcpp::includes.back ().type <= type)
     {
-      for (std::vector <zcpp::include>::iterator i = zcpp::includes.begin ();
-	   i != zcpp::includes.end (); i++)
-	{
-	  if (i->type > type)
-	    {
-	      zcpp::includes.insert (i, zcpp::include (path, type));
-	      return;
-	    }
-	}
+      zcpp::includes.emplace_back (std::move (path), type);
+      return;
     }
-  zcpp::includes.emplace_back (path, type);
+  std::vector <zcpp::include>::iterator it =
+    std::upper_bound (zcpp::includes.begin (), zcpp::includes.end (), type,
+		      [] (int type, const zcpp::include &dir)
+		      {
+			return type < dir.type;
+		      });
+  zcpp::includes.insert (it, zcpp::include (std::move (path), type));
+}
+
+/* Adds the default system directories to the end of the search path.
+   This waits until a header is first looked for, so that files which
+   include nothing don't pay for it. Nothing has recorded the index of a
+   directory before then, so inserting them doesn't move anything. */
+
+void
+zcpp::add_system_includes (void)
+{
+  static bool added;
+  if (added)
+    return;
+  added = true;
+  zcpp::add_includedir ("/usr/local/include", zcpp::include::system);
+  zcpp::add_includedir ("/usr/include", zcpp::include::system);
+}
+
+/* Forgets where headers were found, since files may have been created
+   or removed since */
+
+void
+zcpp::forget_includes (void)
+{
+  lookups.clear ();
+}
+
+/* Returns the index of the directory the header was found in, or
+   std::string::npos if it doesn't exist. While watching, every place
+   searched before it is a dependency too, since a header created there
+   would be found instead. */
+
+std::size_t
+zcpp::find_include (const std::string &spec, std::size_t start,
+		    std::string &filename)
+{
+  zcpp::add_system_includes ();
+  std::pair <std::string, std::size_t> key (spec, start);
+  std::map <std::pair <std::string, std::size_t>,
+	    std::pair <std::size_t, std::string>>::iterator it =
+    lookups.find (key);
+  if (it != lookups.end ())
+    {
+      filename = it->second.second;
+      zcpp::cache_search (spec, start, filename);
+      return it->second.first;
+    }
+
+  bool angle = spec[0] == '<';
+  std::string path = spec.substr (1, spec.size () - 2);
+  std::size_t i;
+  for (i = start; i < zcpp::includes.size (); i++)
+    {
+      if (angle && zcpp::includes[i].type == zcpp::include::quote)
+	continue;
+      filename = zcpp::includes[i].path + '/' + path;
+      if (zcpp::files->is_file (filename))
+	break;
+      if (zcpp::watching)
+	zcpp::watch_dependency (filename);
+    }
+  if (i >= zcpp::includes.size ())
+    {
+      i = std::string::npos;
+      filename.clear ();
+    }
+  lookups[key] = std::make_pair (i, filename);
+  zcpp::cache_search (spec, start, filename);
+  return i;
+}
+
+std::string
+zcpp::stamp_file (const zcpp::translation_unit &unit)
+{
+  return "# " + std::to_string (unit.line) + " \"" + unit.filename + "\"\n";
 }
 
 std::string
 zcpp::stamp_file (void)
 {
-  std::unique_ptr <zcpp::translation_unit> &unit = zcpp::filestack.top ();
-  return "# " + std::to_string (unit->line) + " \"" + unit->filename + "\"\n";
+  return zcpp::stamp_file (*zcpp::filestack.top ());
 }
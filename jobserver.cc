@@ -0,0 +1,165 @@
+/*************************************************************************
+ * jobserver.cc - This file is part of zcpp.                             *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <mutex>
+#include <sstream>
+#include <unistd.h>
+#include "zcpp.hh"
+
+/* Client of the jobserver of GNU make. Under make -jN the job slots of
+   the build are tokens in a pipe or a named fifo shared by every job.
+   Each job runs one thread for free, and takes a token for any other
+   thread or process it starts, writing it back when that is done. */
+
+struct jobserver_state
+{
+  std::mutex lock;
+  int read_fd = -1;
+  int write_fd = -1;
+  std::string held; /* Tokens taken and not written back yet */
+  bool closed = false;
+};
+
+/* Detached prefetch workers may still give back tokens while the program
+   exits, so the state is never freed */
+
+static jobserver_state &state = *new jobserver_state;
+
+bool zcpp::jobserver;
+
+static void
+put_token (char c)
+{
+  while (write (state.write_fd, &c, 1) < 0 && errno == EINTR)
+    ;
+}
+
+/* Make counts a token that is not written back as lost for the rest of
+   the build */
+
+static void
+return_tokens (void)
+{
+  if (state.read_fd < 0)
+    return;
+  std::lock_guard <std::mutex> guard (state.lock);
+  for (char c : state.held)
+    put_token (c);
+  state.held.clear ();
+  state.closed = true;
+}
+
+/* Finds the jobserver in MAKEFLAGS. Newer versions of make pass a fifo
+   as --jobserver-auth=fifo:PATH, older ones the two ends of a pipe as
+   --jobserver-auth=R,W or --jobserver-fds=R,W. If the pipe was not
+   passed down, the rule was not marked as recursive and no other threads
+   are run. */
+
+void
+zcpp::join_jobserver (void)
+{
+  const char *flags = std::getenv ("MAKEFLAGS");
+  if (flags == nullptr)
+    return;
+  std::istringstream words (flags);
+  std::string word;
+  std::string auth;
+  while (words >> word)
+    {
+      if (word.rfind ("--jobserver-auth=", 0) == 0)
+	auth = word.substr (17);
+      else if (word.rfind ("--jobserver-fds=", 0) == 0)
+	auth = word.substr (16);
+    }
+  if (auth.empty ())
+    return;
+  zcpp::jobserver = true;
+
+  if (auth.rfind ("fifo:", 0) == 0)
+    {
+      state.read_fd = open (auth.c_str () + 5,
+			    O_RDWR | O_NONBLOCK | O_CLOEXEC);
+      state.write_fd = state.read_fd;
+    }
+  else
+    {
+      char *end;
+      long r = std::strtol (auth.c_str (), &end, 10);
+      long w = *end == ',' ? std::strtol (end + 1, &end, 10) : -1;
+      if (*end != '\0' || r < 0 || w < 0 || fcntl (r, F_GETFD) < 0
+	  || fcntl (w, F_GETFD) < 0)
+	return;
+
+      /* Tokens are taken without blocking, which needs a file description
+	 of our own since the flags of the pipe are shared by every job */
+      std::string path = "/proc/self/fd/" + std::to_string (r);
+      state.read_fd = open (path.c_str (), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+      state.write_fd = w;
+    }
+  if (state.read_fd >= 0)
+    std::atexit (return_tokens);
+}
+
+/* A forked process runs no other threads, and the tokens it was started
+   with are its parent's to give back */
+
+void
+zcpp::leave_jobserver (void)
+{
+  state.read_fd = -1;
+}
+
+/* Returns whether another thread or process may be started. Without a
+   jobserver the caller's own limit applies. */
+
+bool
+zcpp::acquire_job (void)
+{
+  if (!zcpp::jobserver)
+    return true;
+  if (state.read_fd < 0)
+    return false;
+  std::lock_guard <std::mutex> guard (state.lock);
+  if (state.closed)
+    return false;
+  char c;
+  ssize_t n;
+  do
+    n = read (state.read_fd, &c, 1);
+  while (n < 0 && errno == EINTR);
+  if (n != 1)
+    return false;
+  state.held += c;
+  return true;
+}
+
+void
+zcpp::release_job (void)
+{
+  if (!zcpp::jobserver || state.read_fd < 0)
+    return;
+  std::lock_guard <std::mutex> guard (state.lock);
+  if (state.held.empty ())
+    return;
+  put_token (state.held.back ());
+  state.held.pop_back ();
+}
@@ -0,0 +1,167 @@
+/*************************************************************************
+ * pipeline.cc - This file is part of zcpp.                              *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include "zcpp.hh"
+
+/* Minimum size of the pieces of text passed between stages */
+#define PIPELINE_CHUNK 65536
+
+/* Number of chunks that may be waiting between two stages */
+#define PIPELINE_DEPTH 16
+
+class chunk
+{
+public:
+  std::string text;
+  bool last;
+};
+
+/* Bounded queue between two threads. Chunks are large enough that taking
+   a lock for each costs little, and a thread that has to wait for the
+   other sleeps instead of taking up a processor. */
+
+class chunk_queue
+{
+public:
+  void
+  push (chunk &value)
+  {
+    std::unique_lock <std::mutex> guard (lock);
+    not_full.wait (guard, [this] { return count < PIPELINE_DEPTH; });
+    slots[(head + count) % PIPELINE_DEPTH] = std::move (value);
+    count++;
+    not_empty.notify_one ();
+  }
+
+  void
+  pop (chunk &value)
+  {
+    std::unique_lock <std::mutex> guard (lock);
+    not_empty.wait (guard, [this] { return count > 0; });
+    value = std::move (slots[head]);
+    head = (head + 1) % PIPELINE_DEPTH;
+    count--;
+    not_full.notify_one ();
+  }
+
+private:
+  std::mutex lock;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+  chunk slots[PIPELINE_DEPTH];
+  std::size_t head = 0;
+  std::size_t count = 0;
+};
+
+static void
+strip_chunks (zcpp::comment_stripper &stripper, chunk_queue &queue)
+{
+  chunk c;
+  c.text = zcpp::stamp_file (stripper.unit);
+  do
+    {
+      c.last = !stripper.run (c.text, PIPELINE_CHUNK);
+      queue.push (c);
+      c.text.clear ();
+    }
+  while (!c.last);
+}
+
+static void
+write_chunks (std::ostream &output, chunk_queue &queue)
+{
+  chunk c;
+  do
+    {
+      queue.pop (c);
+      output << c.text;
+    }
+  while (!c.last);
+}
+
+/* Runs stage 1, stage 2 and writing the output of the main file on
+   separate threads. Stage 1 only uses its own translation unit and defers
+   its messages, so it never touches the file stack. Chunks always end at
+   a line boundary, so stage 2 sees the same lines as it would if it had
+   the whole file. */
+
+void
+zcpp::preprocess_pipelined (std::string filename, std::istream &file,
+			    std::ostream &output)
+{
+  zcpp::translation_unit reader (filename, file);
+  zcpp::comment_stripper stripper (reader, true);
+  chunk_queue stripped;
+  chunk_queue expanded;
+  std::thread strip_thread (strip_chunks, std::ref (stripper),
+			    std::ref (stripped));
+  std::thread write_thread (write_chunks, std::ref (output),
+			    std::ref (expanded));
+
+  zcpp::filestack.push (std::make_unique <zcpp::translation_unit> (filename,
+								   file));
+  bool done = false;
+  bool failed = false;
+  try
+    {
+      zcpp::parse_directives ([&] (std::string &buffer)
+	{
+	  if (done)
+	    return false;
+	  chunk c;
+	  stripped.pop (c);
+	  done = c.last;
+	  buffer = std::move (c.text);
+	  zcpp::prefetch_includes (buffer);
+	  return true;
+	},
+	[&] (std::string &result)
+	{
+	  chunk c;
+	  c.text = std::move (result);
+	  c.last = false;
+	  expanded.push (c);
+	});
+    }
+  catch (const zcpp::fatal_error &)
+    {
+      /* The other threads still have to be stopped */
+      failed = true;
+      while (!done)
+	{
+	  chunk c;
+	  stripped.pop (c);
+	  done = c.last;
+	}
+    }
+  chunk end;
+  end.last = true;
+  expanded.push (end);
+
+  strip_thread.join ();
+  write_thread.join ();
+  stripper.flush_messages ();
+  if (failed)
+    throw zcpp::fatal_error ();
+  zcpp::drop_prefetched ();
+  zcpp::filestack.pop ();
+}
@@ -0,0 +1,243 @@
+/*************************************************************************
+ * prefetch.cc - This file is part of zcpp.                              *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include "zcpp.hh"
+
+/* Maximum number of include files held in memory before they are used */
+#define PREFETCH_MAX 256
+
+class prefetch_entry
+{
+public:
+  std::string spec;
+  std::vector <zcpp::include> dirs;
+  std::size_t depth; /* Files open when it was queued */
+  bool started;
+  bool done;
+  bool found;
+  std::size_t dir;
+  std::string filename;
+  std::string contents;
+
+  prefetch_entry (std::string spec, std::vector <zcpp::include> dirs,
+		  std::size_t depth) :
+    spec (std::move (spec)), dirs (std::move (dirs)), depth (depth),
+    started (false), done (false), found (false) {}
+};
+
+/* Worker threads are detached and may still be blocked on the condition
+   variable when the program exits, so the shared state is never freed */
+
+struct prefetch_state
+{
+  std::mutex lock;
+  std::condition_variable queued;
+  std::condition_variable finished;
+  std::deque <std::shared_ptr <prefetch_entry>> queue;
+  std::map <std::string, std::shared_ptr <prefetch_entry>> entries;
+  unsigned int workers = 0;
+};
+
+static prefetch_state &state = *new prefetch_state;
+
+unsigned int zcpp::prefetch_threads = 4;
+unsigned long zcpp::prefetch_hits;
+
+static void
+read_include (prefetch_entry &entry)
+{
+  bool angle = entry.spec[0] == '<';
+  std::string path = entry.spec.substr (1, entry.spec.size () - 2);
+  for (std::size_t i = 0; i < entry.dirs.size (); i++)
+    {
+      if (angle && entry.dirs[i].type == zcpp::include::quote)
+	continue;
+      std::string filename = entry.dirs[i].path + '/' + path;
+
+      /* Files in memory are cheaper to open than to hand over */
+      std::string_view data;
+      if (zcpp::files->view (filename, data))
+	return;
+      std::unique_ptr <std::istream> file = zcpp::files->open (filename);
+      if (file == nullptr)
+	continue;
+      std::ostringstream stream;
+      stream << file->rdbuf ();
+      entry.dir = i;
+      entry.filename = filename;
+      entry.contents = stream.str ();
+      entry.found = true;
+      return;
+    }
+}
+
+static void
+prefetch_worker (void)
+{
+  std::unique_lock <std::mutex> guard (state.lock);
+  while (true)
+    {
+      /* A job slot of the build is not held while idle */
+      if (state.queue.empty () && zcpp::jobserver)
+	{
+	  state.workers--;
+	  zcpp::release_job ();
+	  return;
+	}
+      state.queued.wait (guard, [] { return !state.queue.empty (); });
+      std::shared_ptr <prefetch_entry> entry = state.queue.front ();
+      state.queue.pop_front ();
+      entry->started = true;
+      guard.unlock ();
+      read_include (*entry);
+      guard.lock ();
+      entry->done = true;
+      state.finished.notify_all ();
+    }
+}
+
+static void
+queue_include (std::string spec)
+{
+  if (state.entries.size () >= PREFETCH_MAX
+      || state.entries.find (spec) != state.entries.end ())
+    return;
+  zcpp::add_system_includes ();
+  std::shared_ptr <prefetch_entry> entry =
+    std::make_shared <prefetch_entry> (spec, zcpp::includes,
+				       zcpp::filestack.size ());
+  state.entries[spec] = entry;
+  state.queue.push_back (entry);
+  if (state.workers < zcpp::prefetch_threads && zcpp::acquire_job ())
+    {
+      std::thread (prefetch_worker).detach ();
+      state.workers++;
+    }
+  state.queued.notify_one ();
+}
+
+void
+zcpp::prefetch_includes (const std::string &s)
+{
+  if (zcpp::prefetch_threads == 0)
+    return;
+  std::lock_guard <std::mutex> guard (state.lock);
+  std::size_t pos = 0;
+  while (pos < s.size ())
+    {
+      std::size_t end = s.find ('\n', pos);
+      if (end == std::string::npos)
+	end = s.size ();
+      std::size_t i = pos;
+      pos = end + 1;
+
+      while (i < end && std::isspace (s[i]))
+	i++;
+      if (i >= end || s[i++] != '#')
+	continue;
+      while (i < end && std::isspace (s[i]))
+	i++;
+      if (s.compare (i, 7, "include") != 0)
+	continue;
+      i += 7;
+      while (i < end && std::isspace (s[i]))
+	i++;
+      if (i >= end || (s[i] != '<' && s[i] != '"'))
+	continue;
+      std::size_t close = s.find (s[i] == '<' ? '>' : '"', i + 1);
+      if (close < end)
+	queue_include (s.substr (i, close - i + 1));
+    }
+}
+
+static void
+unqueue (const std::shared_ptr <prefetch_entry> &entry)
+{
+  for (std::deque <std::shared_ptr <prefetch_entry>>::iterator i =
+	 state.queue.begin (); i != state.queue.end (); i++)
+    {
+      if (*i == entry)
+	{
+	  state.queue.erase (i);
+	  break;
+	}
+    }
+}
+
+/* Called when a file ends. Includes queued from it that it never got to,
+   such as ones in groups that were skipped or of headers that were
+   already included, would otherwise fill up the limit for good. */
+
+void
+zcpp::drop_prefetched (void)
+{
+  if (zcpp::prefetch_threads == 0)
+    return;
+  std::lock_guard <std::mutex> guard (state.lock);
+  std::map <std::string, std::shared_ptr <prefetch_entry>>::iterator it =
+    state.entries.begin ();
+  while (it != state.entries.end ())
+    {
+      if (it->second->depth < zcpp::filestack.size ())
+	{
+	  it++;
+	  continue;
+	}
+      if (!it->second->started)
+	unqueue (it->second);
+      it = state.entries.erase (it);
+    }
+}
+
+bool
+zcpp::take_prefetched (const std::string &spec, std::string &filename,
+		       std::size_t &dir, std::string &contents)
+{
+  /* A forked process has no workers, and a lock may have been held by one
+     of its parent's */
+  if (zcpp::prefetch_threads == 0)
+    return false;
+  std::unique_lock <std::mutex> guard (state.lock);
+  std::map <std::string, std::shared_ptr <prefetch_entry>>::iterator it =
+    state.entries.find (spec);
+  if (it == state.entries.end ())
+    return false;
+  std::shared_ptr <prefetch_entry> entry = it->second;
+  state.entries.erase (it);
+
+  /* Reading the file ourselves is faster than waiting for a worker to
+     get around to it */
+  if (!entry->started)
+    {
+      unqueue (entry);
+      return false;
+    }
+  state.finished.wait (guard, [&] { return entry->done; });
+  if (!entry->found)
+    return false;
+  dir = entry->dir;
+  filename = std::move (entry->filename);
+  contents = std::move (entry->contents);
+  zcpp::prefetch_hits++;
+  return true;
+}
@@ -0,0 +1,261 @@
+/*************************************************************************
+ * region.cc - This file is part of zcpp.                                *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <algorithm>
+#include "zcpp.hh"
+
+/* Most include files have the same effect every time they are included
+   with the same definitions of the macros they use. Including a file is
+   recorded as a region: its output, the macros it read and the macros
+   it defined or removed. When the file is included again and none of
+   the macros it read have changed, the region is replayed instead of
+   processing the file again.
+
+   Recording a file records the files it includes too, so regions nest.
+   A region only writes to the innermost recording, which passes what it
+   read and wrote on to the one outside it when it ends. Files are only
+   recorded from their second inclusion, unless there are several
+   configurations and every file is likely to be seen again. */
+
+/* Regions recorded for each file. Files included under many different
+   definitions stop being recorded after this many. */
+#define REGIONS_MAX 8
+
+class recording
+{
+public:
+  zcpp::region *r;
+  std::unique_ptr <zcpp::region> owned; /* Stored once it is complete */
+  zcpp::name_set seen; /* Names read or written by r */
+  std::size_t base; /* Files open when the region began */
+  std::size_t deepest; /* Most files open at once within it */
+  unsigned long reported; /* Messages reported before it began */
+};
+
+bool zcpp::recording_region;
+unsigned long zcpp::regions_replayed;
+unsigned long zcpp::regions_entered;
+
+static std::vector <recording> recordings;
+static std::multimap <std::string, zcpp::region> regions;
+static std::map <std::string, unsigned long> inclusions;
+
+static bool
+same_macro (const std::shared_ptr <zcpp::macro> *a,
+	    const std::shared_ptr <zcpp::macro> &b)
+{
+  if (a == nullptr || b == nullptr)
+    return a == nullptr && b == nullptr;
+  return *a == b || ((*a)->func == b->func && (*a)->args == b->args
+		     && (*a)->sub == b->sub);
+}
+
+/* Returns true if every macro the region read has the same definition
+   now, and its includes would not be nested too deep */
+
+bool
+zcpp::region::matches (void) const
+{
+  if (zcpp::filestack.size () + depth > zcpp::max_include_depth)
+    return false;
+  for (const std::pair <std::string, std::shared_ptr <zcpp::macro>> &read
+	 : reads)
+    {
+      if (!same_macro (zcpp::defines.find (read.first), read.second))
+	return false;
+    }
+  return true;
+}
+
+/* Appends the output of the region and applies its effects, which also
+   become part of any region being recorded */
+
+void
+zcpp::region::replay (std::string &result) const
+{
+  if (zcpp::recording_region)
+    {
+      for (const std::pair <std::string, std::shared_ptr <zcpp::macro>>
+	     &read : reads)
+	zcpp::record_read (read.first, zcpp::defines.find (read.first));
+      zcpp::record_depth (zcpp::filestack.size () + depth);
+    }
+  result += output;
+  zcpp::charge_line (output.size ());
+  for (const std::pair <std::string, std::shared_ptr <zcpp::macro>> &write
+	 : writes)
+    {
+      if (zcpp::recording_region)
+	zcpp::record_write (write.first, write.second);
+      if (write.second == nullptr)
+	zcpp::defines.erase (write.first);
+      else
+	zcpp::defines.set (write.first, write.second);
+    }
+}
+
+void
+zcpp::start_recording (zcpp::region &r)
+{
+  recording rec;
+  rec.r = &r;
+  rec.base = zcpp::filestack.size ();
+  rec.deepest = rec.base;
+  rec.reported = zcpp::diagnostics_reported ();
+  recordings.push_back (std::move (rec));
+  zcpp::recording_region = true;
+}
+
+/* Ends the innermost recording, and returns false if the region can't be
+   replayed because it wrote messages or failed */
+
+bool
+zcpp::stop_recording (void)
+{
+  recording rec = std::move (recordings.back ());
+  recordings.pop_back ();
+  zcpp::recording_region = !recordings.empty ();
+  rec.r->depth = rec.deepest - rec.base;
+  if (zcpp::recording_region)
+    {
+      recording &outer = recordings.back ();
+      for (const std::pair <std::string, std::shared_ptr <zcpp::macro>>
+	     &read : rec.r->reads)
+	{
+	  if (outer.seen.emplace (read.first).second)
+	    outer.r->reads.push_back (read);
+	}
+      for (const std::pair <std::string, std::shared_ptr <zcpp::macro>>
+	     &write : rec.r->writes)
+	{
+	  outer.seen.emplace (write.first);
+	  outer.r->writes.push_back (write);
+	}
+      outer.deepest = std::max (outer.deepest, rec.deepest);
+    }
+  return !zcpp::exiting && zcpp::diagnostics_reported () == rec.reported;
+}
+
+/* Forgets every recording still open after a fatal error */
+
+void
+zcpp::drop_recordings (void)
+{
+  recordings.clear ();
+  zcpp::recording_region = false;
+}
+
+/* Forgets every region and how often each file was included, before
+   preprocessing files whose contents may differ under the same names */
+
+void
+zcpp::forget_regions (void)
+{
+  zcpp::drop_recordings ();
+  regions.clear ();
+  inclusions.clear ();
+}
+
+/* Only the first use of a name matters, and a name the region defined
+   itself does not depend on anything outside it */
+
+void
+zcpp::record_read (std::string_view name,
+		   const std::shared_ptr <zcpp::macro> *value)
+{
+  recording &rec = recordings.back ();
+  if (rec.seen.find (name) != rec.seen.end ())
+    return;
+  rec.seen.emplace (name);
+  rec.r->reads.emplace_back (name, value == nullptr ? nullptr : *value);
+}
+
+/* Defining a macro that is already defined warns about it, so a region
+   that defines a name also depends on whether it was defined before */
+
+void
+zcpp::record_write (std::string_view name,
+		    std::shared_ptr <zcpp::macro> value)
+{
+  recording &rec = recordings.back ();
+  if (value != nullptr && rec.seen.find (name) == rec.seen.end ())
+    record_read (name, zcpp::defines.find (name));
+  rec.seen.emplace (name);
+  rec.r->writes.emplace_back (name, std::move (value));
+}
+
+void
+zcpp::record_depth (std::size_t files)
+{
+  recording &rec = recordings.back ();
+  rec.deepest = std::max (rec.deepest, files);
+}
+
+/* Appends the output of a region recorded earlier and applies its
+   effects, if there is one whose reads match the current macros */
+
+bool
+zcpp::replay_region (std::string &result, const std::string &filename)
+{
+  if (zcpp::watching)
+    return false;
+  zcpp::regions_entered++;
+  std::pair <std::multimap <std::string, zcpp::region>::iterator,
+	     std::multimap <std::string, zcpp::region>::iterator> range =
+    regions.equal_range (filename);
+  for (std::multimap <std::string, zcpp::region>::iterator it = range.first;
+       it != range.second; it++)
+    {
+      if (it->second.matches ())
+	{
+	  it->second.replay (result);
+	  zcpp::regions_replayed++;
+	  return true;
+	}
+    }
+  return false;
+}
+
+/* Starts recording the file about to be processed, if it is worth it,
+   and returns true if it did */
+
+bool
+zcpp::begin_region (const std::string &filename)
+{
+  if (zcpp::watching)
+    return false;
+  if (++inclusions[filename] < 2 && zcpp::configs.empty ())
+    return false;
+  if (regions.count (filename) >= REGIONS_MAX)
+    return false;
+  std::unique_ptr <zcpp::region> r = std::make_unique <zcpp::region> ();
+  zcpp::start_recording (*r);
+  recordings.back ().owned = std::move (r);
+  return true;
+}
+
+void
+zcpp::end_region (const std::string &filename, std::string_view output)
+{
+  std::unique_ptr <zcpp::region> r = std::move (recordings.back ().owned);
+  if (zcpp::stop_recording ())
+    {
+      r->output = output;
+      regions.emplace (filename, std::move (*r));
+    }
+}
@@ -0,0 +1,381 @@
+/*************************************************************************
+ * speculate.cc - This file is part of zcpp.                             *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <algorithm>
+#include <cctype>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "zcpp.hh"
+
+/* Speculative preprocessing of the files included by the main file.
+   After each #include line of the main file, the #include lines after it
+   are started in forked processes. A fork is a snapshot of everything,
+   so each one sees the macros as they are at that point. It records the
+   file as a region, with the macros it read and the macros it defined or
+   removed, and sends it back through a pipe. When the main file reaches
+   one of those lines, the region is used if none of the macros it read
+   have changed since, and otherwise the file is processed again. No
+   other threads may be running when it forks, so include files are not
+   read ahead while speculating. */
+
+class speculation
+{
+public:
+  std::string spec;
+  pid_t pid;
+  int fd;
+};
+
+unsigned int zcpp::speculate_jobs;
+unsigned long zcpp::speculations_used;
+unsigned long zcpp::speculations_started;
+
+/* Keyed by the offset of the #include line in the main file */
+static std::map <std::size_t, speculation> running;
+static std::size_t scanned; /* Offset of the first line not looked at */
+
+static void
+put_size (std::string &out, std::uint64_t size)
+{
+  out.append ((const char *) &size, sizeof size);
+}
+
+static void
+put_string (std::string &out, std::string_view s)
+{
+  put_size (out, s.size ());
+  out += s;
+}
+
+/* Macros are sent as their parameters and expanded body, which splits
+   into the same pieces again */
+
+static void
+put_macro (std::string &out, const std::shared_ptr <zcpp::macro> &macro)
+{
+  if (macro == nullptr)
+    {
+      out += '\0';
+      return;
+    }
+  out += macro->func ? '\2' : '\1';
+  put_size (out, macro->args.size ());
+  for (const std::string &arg : macro->args)
+    put_string (out, arg);
+  std::string body;
+  for (const std::string &text : macro->sub)
+    body += text;
+  put_string (out, body);
+}
+
+static void
+put_macros (std::string &out,
+	    const std::vector <std::pair <std::string,
+					  std::shared_ptr <zcpp::macro>>>
+	    &macros)
+{
+  put_size (out, macros.size ());
+  for (const std::pair <std::string, std::shared_ptr <zcpp::macro>> &m
+	 : macros)
+    {
+      put_string (out, m.first);
+      put_macro (out, m.second);
+    }
+}
+
+class region_reader
+{
+public:
+  explicit region_reader (std::string_view data) : data (data), pos (0),
+						   good (true) {}
+
+  std::uint64_t
+  size (void)
+  {
+    std::uint64_t size = 0;
+    if (data.size () - pos < sizeof size)
+      good = false;
+    else
+      {
+	std::memcpy (&size, data.data () + pos, sizeof size);
+	pos += sizeof size;
+      }
+    return size;
+  }
+
+  std::string_view
+  string (void)
+  {
+    std::uint64_t length = size ();
+    if (data.size () - pos < length)
+      {
+	good = false;
+	return std::string_view ();
+      }
+    pos += length;
+    return data.substr (pos - length, length);
+  }
+
+  std::shared_ptr <zcpp::macro>
+  macro (void)
+  {
+    if (pos >= data.size ())
+      {
+	good = false;
+	return nullptr;
+      }
+    char kind = data[pos++];
+    if (kind == '\0')
+      return nullptr;
+    std::vector <std::string> args (size ());
+    for (std::size_t i = 0; good && i < args.size (); i++)
+      args[i] = string ();
+    std::string_view body = string ();
+    if (!good)
+      return nullptr;
+    return std::make_shared <zcpp::macro> (kind == '\2', args, body);
+  }
+
+  void
+  macros (std::vector <std::pair <std::string,
+				  std::shared_ptr <zcpp::macro>>> &macros)
+  {
+    std::uint64_t count = size ();
+    for (std::uint64_t i = 0; good && i < count; i++)
+      {
+	std::string name (string ());
+	std::shared_ptr <zcpp::macro> value = macro ();
+	macros.emplace_back (std::move (name), std::move (value));
+      }
+  }
+
+  bool
+  done (void) const
+  {
+    return good && pos == data.size ();
+  }
+
+private:
+  std::string_view data;
+  std::size_t pos;
+  bool good;
+};
+
+static bool
+write_all (int fd, std::string_view data)
+{
+  while (!data.empty ())
+    {
+      ssize_t n = write (fd, data.data (), data.size ());
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return false;
+      data.remove_prefix (n);
+    }
+  return true;
+}
+
+/* Runs in the forked process. Any message means the file has to be
+   processed again where it can be written in order. */
+
+[[noreturn]] static void
+speculate (const std::string &spec, int fd)
+{
+  /* Nothing waiting for the output of the parent should wait for this */
+  int null = open ("/dev/null", O_RDWR);
+  dup2 (null, STDIN_FILENO);
+  dup2 (null, STDOUT_FILENO);
+  dup2 (null, STDERR_FILENO);
+  close (null);
+
+  zcpp::silence_diagnostics ();
+  zcpp::prefetch_threads = 0;
+  zcpp::speculate_jobs = 0;
+  zcpp::leave_jobserver ();
+
+  std::string filename;
+  std::size_t dir = zcpp::find_include (spec, 0, filename);
+  std::unique_ptr <std::istream> file;
+  if (dir != std::string::npos)
+    file = zcpp::files->open (filename);
+  if (file != nullptr)
+    {
+      zcpp::region r;
+      std::size_t embedded = zcpp::embedded.size ();
+      zcpp::start_recording (r);
+      try
+	{
+	  zcpp::preprocess (r.output, filename, *file, dir);
+	}
+      catch (const zcpp::fatal_error &)
+	{
+	  _exit (0);
+	}
+      /* Markers for resources embedded here mean nothing to the parent */
+      if (zcpp::stop_recording () && zcpp::embedded.size () == embedded)
+	{
+	  std::string out;
+	  put_string (out, r.output);
+	  put_macros (out, r.reads);
+	  put_macros (out, r.writes);
+	  write_all (fd, out);
+	}
+    }
+  _exit (0);
+}
+
+static void
+abandon (std::map <std::size_t, speculation>::iterator it)
+{
+  kill (it->second.pid, SIGKILL);
+  close (it->second.fd);
+  waitpid (it->second.pid, nullptr, 0);
+  running.erase (it);
+  zcpp::release_job ();
+}
+
+/* Starts the #include lines after pos in the main file, up to the number
+   of jobs allowed at once. Only lines that parse_include would accept
+   without a message are started. */
+
+void
+zcpp::speculate_includes (std::string_view input, std::size_t pos)
+{
+  std::size_t i = std::max (pos, scanned);
+  while (running.size () < zcpp::speculate_jobs && i < input.size ())
+    {
+      std::size_t end = std::min (input.find ('\n', i), input.size ());
+      std::size_t start = i;
+      i = end + 1;
+      scanned = i;
+
+      while (start < end && std::isspace (input[start]))
+	start++;
+      if (start >= end || input[start] != '#')
+	continue;
+      std::size_t hash = start++;
+      while (start < end && std::isspace (input[start]))
+	start++;
+      if (input.compare (start, 7, "include") != 0)
+	continue;
+      start += 7;
+      if (start >= end || !std::isspace (input[start]))
+	continue;
+      while (start < end && std::isspace (input[start]))
+	start++;
+      if (start >= end || (input[start] != '<' && input[start] != '"'))
+	continue;
+      std::size_t spec_end = input.find (input[start] == '<' ? '>' : '"',
+					 start + 1);
+      if (spec_end >= end)
+	continue;
+      std::size_t rest = spec_end + 1;
+      while (rest < end && std::isspace (input[rest]))
+	rest++;
+      if (rest < end)
+	continue;
+
+      /* The line is looked at again once a job slot is free */
+      if (!zcpp::acquire_job ())
+	{
+	  scanned = hash;
+	  return;
+	}
+      speculation s;
+      s.spec = input.substr (start, spec_end - start + 1);
+      int fds[2];
+      if (pipe (fds) < 0)
+	{
+	  zcpp::release_job ();
+	  return;
+	}
+
+      /* The fork would write anything still buffered again */
+      std::cout.flush ();
+      std::cerr.flush ();
+      s.pid = fork ();
+      if (s.pid < 0)
+	{
+	  close (fds[0]);
+	  close (fds[1]);
+	  zcpp::release_job ();
+	  return;
+	}
+      if (s.pid == 0)
+	{
+	  close (fds[0]);
+	  speculate (s.spec, fds[1]);
+	}
+      close (fds[1]);
+      s.fd = fds[0];
+      running.emplace (hash, std::move (s));
+      zcpp::speculations_started++;
+    }
+}
+
+/* Uses the result started for the #include line at pos, if there is one
+   and it still applies */
+
+bool
+zcpp::splice_speculation (std::string &result, std::size_t pos)
+{
+  /* Lines before this one were skipped by a conditional */
+  while (!running.empty () && running.begin ()->first < pos)
+    abandon (running.begin ());
+  std::map <std::size_t, speculation>::iterator it = running.find (pos);
+  if (it == running.end ())
+    return false;
+
+  std::string data;
+  char buffer[65536];
+  while (true)
+    {
+      ssize_t n = read (it->second.fd, buffer, sizeof buffer);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	break;
+      data.append (buffer, n);
+    }
+  abandon (it);
+
+  zcpp::region r;
+  region_reader reader (data);
+  r.output = reader.string ();
+  reader.macros (r.reads);
+  reader.macros (r.writes);
+  if (!reader.done () || !r.matches ())
+    return false;
+  r.replay (result);
+  result += zcpp::stamp_file ();
+  zcpp::speculations_used++;
+  return true;
+}
+
+void
+zcpp::end_speculation (void)
+{
+  while (!running.empty ())
+    abandon (running.begin ());
+  scanned = 0;
+}
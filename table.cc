@@ -0,0 +1,397 @@
+/*************************************************************************
+ * table.cc - This file is part of zcpp.                                 *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <mutex>
+#include "zcpp.hh"
+
+/* Bits of the name hash used at each level of the trie */
+#define TABLE_BITS 5
+
+#define HASH_BITS 64
+
+struct zcpp::macro_table::entry
+{
+  std::string name;
+  std::uint64_t hash;
+  std::shared_ptr <macro> value;
+  std::pair <std::uint64_t, std::uint64_t> print;
+};
+
+/* Each slot holds either an entry or a child node. Nodes below the last
+   level of the hash only hold entries whose names have the same hash. */
+
+struct zcpp::macro_table::node
+{
+  std::uint32_t bitmap = 0;
+  std::vector <std::shared_ptr <const entry>> entries;
+  std::vector <std::shared_ptr <const node>> children;
+};
+
+typedef zcpp::macro_table::entry entry;
+typedef zcpp::macro_table::node node;
+
+struct predefined_macro
+{
+  std::string_view name;
+  bool func;
+  std::string_view value;
+};
+
+static constexpr predefined_macro predefined[] = {
+  {"__STDC__", false, "1"},
+  {"__STDC_HOSTED__", false, "1"},
+  {"__STDC_VERSION__", false, "199409L"},
+  {"__CHAR_BIT__", false, "8"},
+  {"__SIZEOF_INT__", false, SIZEOF_INT},
+  {"__SIZEOF_LONG__", false, SIZEOF_LONG},
+  {"__SIZEOF_LONG_LONG__", false, SIZEOF_LONG_LONG},
+  {"__SIZEOF_SHORT__", false, SIZEOF_SHORT},
+  {"__SIZEOF_POINTER__", false, SIZEOF_POINTER},
+  {"__SIZEOF_FLOAT__", false, SIZEOF_FLOAT},
+  {"__SIZEOF_DOUBLE__", false, SIZEOF_DOUBLE},
+  {"__SIZEOF_LONG_DOUBLE__", false, SIZEOF_LONG_DOUBLE},
+  {"__SIZEOF_SIZE_T__", false, SIZEOF_SIZE_T},
+  {"__SIZEOF_WCHAR_T__", false, SIZEOF_WCHAR_T},
+  {"__SIZEOF_WINT_T__", false, SIZEOF_WINT_T},
+  {"__SIZEOF_PTRDIFF_T__", false, SIZEOF_PTRDIFF_T},
+  {ARCH_MACRO, false, "1"},
+  {"__has_attribute", true, "0"}, /* Don't support any attributes */
+  {"__has_feature", true, "0"}
+};
+
+#define PREDEFINED_COUNT (sizeof predefined / sizeof *predefined)
+
+static std::shared_ptr <zcpp::macro> predefined_values[PREDEFINED_COUNT];
+static std::pair <std::uint64_t, std::uint64_t>
+predefined_prints[PREDEFINED_COUNT];
+static std::once_flag predefined_built[PREDEFINED_COUNT];
+
+static constexpr std::array <std::uint64_t, MACRO_FILTER_BITS / 64>
+predefined_filter (void)
+{
+  std::array <std::uint64_t, MACRO_FILTER_BITS / 64> filter {};
+  for (const predefined_macro &m : predefined)
+    {
+      std::uint64_t hash = zcpp::name_hash (m.name);
+      std::uint64_t a = hash % MACRO_FILTER_BITS;
+      std::uint64_t b = (hash >> 32) % MACRO_FILTER_BITS;
+      filter[a / 64] |= (std::uint64_t) 1 << a % 64;
+      filter[b / 64] |= (std::uint64_t) 1 << b % 64;
+    }
+  return filter;
+}
+
+std::array <std::uint64_t, MACRO_FILTER_BITS / 64> zcpp::macro_filter =
+  predefined_filter ();
+
+static std::size_t
+slot_index (const node *n, std::uint32_t bit)
+{
+  return __builtin_popcount (n->bitmap & (bit - 1));
+}
+
+static std::pair <std::uint64_t, std::uint64_t>
+fingerprint_macro (std::string_view name, const zcpp::macro &macro)
+{
+  zcpp::hash h;
+  h.update (std::string (name));
+  h.update (std::to_string (macro.func));
+  for (const std::string &arg : macro.args)
+    h.update (arg);
+  for (const std::string &text : macro.sub)
+    h.update (text);
+  return h.digest ();
+}
+
+/* Returns the index of the predefined macro with the given name, or -1 */
+
+static int
+predefined_index (std::string_view name)
+{
+  for (std::size_t i = 0; i < PREDEFINED_COUNT; i++)
+    {
+      if (predefined[i].name == name)
+	return i;
+    }
+  return -1;
+}
+
+static void
+build_predefined (std::size_t i)
+{
+  std::call_once (predefined_built[i], [i] (void)
+    {
+      std::vector <std::string> args;
+      if (predefined[i].func)
+	args.emplace_back ("x");
+      predefined_values[i] =
+	std::make_shared <zcpp::macro> (predefined[i].func, args,
+					predefined[i].value);
+      predefined_prints[i] =
+	fingerprint_macro (predefined[i].name, *predefined_values[i]);
+    });
+}
+
+static const entry *
+find_entry (const node *n, std::string_view name, std::uint64_t hash)
+{
+  for (unsigned int shift = 0; n != nullptr; shift += TABLE_BITS)
+    {
+      if (shift >= HASH_BITS)
+	{
+	  for (const std::shared_ptr <const entry> &e : n->entries)
+	    {
+	      if (e->name == name)
+		return e.get ();
+	    }
+	  return nullptr;
+	}
+      std::uint32_t bit = 1U << (hash >> shift & ((1 << TABLE_BITS) - 1));
+      if (!(n->bitmap & bit))
+	return nullptr;
+      std::size_t i = slot_index (n, bit);
+      if (n->children[i] == nullptr)
+	return n->entries[i]->name == name ? n->entries[i].get () : nullptr;
+      n = n->children[i].get ();
+    }
+  return nullptr;
+}
+
+static std::shared_ptr <const node>
+insert (const node *n, unsigned int shift,
+	const std::shared_ptr <const entry> &e, const entry *&replaced)
+{
+  std::shared_ptr <node> copy =
+    n == nullptr ? std::make_shared <node> () : std::make_shared <node> (*n);
+  if (shift >= HASH_BITS)
+    {
+      for (std::shared_ptr <const entry> &other : copy->entries)
+	{
+	  if (other->name == e->name)
+	    {
+	      replaced = other.get ();
+	      other = e;
+	      return copy;
+	    }
+	}
+      copy->entries.push_back (e);
+      return copy;
+    }
+
+  std::uint32_t bit = 1U << (e->hash >> shift & ((1 << TABLE_BITS) - 1));
+  std::size_t i = slot_index (copy.get (), bit);
+  if (!(copy->bitmap & bit))
+    {
+      copy->bitmap |= bit;
+      copy->entries.insert (copy->entries.begin () + i, e);
+      copy->children.insert (copy->children.begin () + i, nullptr);
+    }
+  else if (copy->children[i] != nullptr)
+    copy->children[i] = insert (copy->children[i].get (), shift + TABLE_BITS,
+				e, replaced);
+  else if (copy->entries[i]->name == e->name)
+    {
+      replaced = copy->entries[i].get ();
+      copy->entries[i] = e;
+    }
+  else
+    {
+      const entry *unused = nullptr;
+      copy->children[i] = insert (insert (nullptr, shift + TABLE_BITS,
+					  copy->entries[i], unused).get (),
+				  shift + TABLE_BITS, e, unused);
+      copy->entries[i] = nullptr;
+    }
+  return copy;
+}
+
+/* Returns n unchanged if name is not in it, or nullptr if removing it
+   leaves n empty */
+
+static std::shared_ptr <const node>
+remove (const std::shared_ptr <const node> &n, unsigned int shift,
+	std::string_view name, std::uint64_t hash, const entry *&removed)
+{
+  if (shift >= HASH_BITS)
+    {
+      for (std::size_t i = 0; i < n->entries.size (); i++)
+	{
+	  if (n->entries[i]->name == name)
+	    {
+	      if (n->entries.size () == 1)
+		{
+		  removed = n->entries[i].get ();
+		  return nullptr;
+		}
+	      std::shared_ptr <node> copy = std::make_shared <node> (*n);
+	      removed = n->entries[i].get ();
+	      copy->entries.erase (copy->entries.begin () + i);
+	      return copy;
+	    }
+	}
+      return n;
+    }
+
+  std::uint32_t bit = 1U << (hash >> shift & ((1 << TABLE_BITS) - 1));
+  if (!(n->bitmap & bit))
+    return n;
+  std::size_t i = slot_index (n.get (), bit);
+  std::shared_ptr <const node> child;
+  if (n->children[i] != nullptr)
+    {
+      child = remove (n->children[i], shift + TABLE_BITS, name, hash,
+		      removed);
+      if (child == n->children[i])
+	return n;
+    }
+  else if (n->entries[i]->name == name)
+    removed = n->entries[i].get ();
+  else
+    return n;
+
+  if (child == nullptr && n->bitmap == bit)
+    return nullptr;
+  std::shared_ptr <node> copy = std::make_shared <node> (*n);
+  if (child != nullptr)
+    copy->children[i] = child;
+  else
+    {
+      copy->bitmap &= ~bit;
+      copy->entries.erase (copy->entries.begin () + i);
+      copy->children.erase (copy->children.begin () + i);
+    }
+  return copy;
+}
+
+const std::shared_ptr <zcpp::macro> *
+zcpp::macro_table::find (std::string_view name, std::uint64_t hash) const
+{
+  const entry *e = find_entry (root.get (), name, hash);
+  if (e != nullptr)
+    return e->value != nullptr ? &e->value : nullptr;
+  int i = predefined_index (name);
+  if (i < 0)
+    return nullptr;
+  build_predefined (i);
+  return &predefined_values[i];
+}
+
+std::size_t
+zcpp::macro_table::size (void) const
+{
+  std::size_t size = count;
+  for (const predefined_macro &m : predefined)
+    {
+      if (find_entry (root.get (), m.name, zcpp::name_hash (m.name))
+	  == nullptr)
+	size++;
+    }
+  return size;
+}
+
+std::pair <std::uint64_t, std::uint64_t>
+zcpp::macro_table::fingerprint (void) const
+{
+  std::pair <std::uint64_t, std::uint64_t> result = print;
+  for (std::size_t i = 0; i < PREDEFINED_COUNT; i++)
+    {
+      std::string_view name = predefined[i].name;
+      if (find_entry (root.get (), name, zcpp::name_hash (name)) == nullptr)
+	{
+	  build_predefined (i);
+	  result.first += predefined_prints[i].first;
+	  result.second += predefined_prints[i].second;
+	}
+    }
+  return result;
+}
+
+/* Defines or redefines a macro, returning true if it replaced an existing
+   definition */
+
+bool
+zcpp::macro_table::set (std::string_view name, std::shared_ptr <macro> value)
+{
+  std::shared_ptr <entry> e = std::make_shared <entry> ();
+  e->name = name;
+  e->hash = zcpp::name_hash (name);
+  e->print = fingerprint_macro (name, *value);
+  e->value = std::move (value);
+
+  std::uint64_t a = e->hash % MACRO_FILTER_BITS;
+  std::uint64_t b = (e->hash >> 32) % MACRO_FILTER_BITS;
+  zcpp::macro_filter[a / 64] |= (std::uint64_t) 1 << a % 64;
+  zcpp::macro_filter[b / 64] |= (std::uint64_t) 1 << b % 64;
+
+  const entry *replaced = nullptr;
+  std::shared_ptr <const node> updated = insert (root.get (), 0, e, replaced);
+  bool defined = replaced != nullptr ? replaced->value != nullptr
+    : predefined_index (name) >= 0;
+  if (replaced != nullptr && replaced->value != nullptr)
+    {
+      print.first -= replaced->print.first;
+      print.second -= replaced->print.second;
+    }
+  else
+    count++;
+  print.first += e->print.first;
+  print.second += e->print.second;
+  root = std::move (updated);
+  return defined;
+}
+
+bool
+zcpp::macro_table::erase (std::string_view name)
+{
+  std::uint64_t hash = zcpp::name_hash (name);
+  if (predefined_index (name) >= 0)
+    {
+      /* Hide the predefined macro */
+      const entry *old = find_entry (root.get (), name, hash);
+      if (old != nullptr && old->value == nullptr)
+	return false;
+      std::shared_ptr <entry> e = std::make_shared <entry> ();
+      e->name = name;
+      e->hash = hash;
+      e->print = std::make_pair (0, 0);
+      const entry *replaced = nullptr;
+      std::shared_ptr <const node> updated =
+	insert (root.get (), 0, e, replaced);
+      if (replaced != nullptr)
+	{
+	  print.first -= replaced->print.first;
+	  print.second -= replaced->print.second;
+	  count--;
+	}
+      root = std::move (updated);
+      return true;
+    }
+
+  if (root == nullptr)
+    return false;
+  const entry *removed = nullptr;
+  std::shared_ptr <const node> updated =
+    remove (root, 0, name, hash, removed);
+  if (removed == nullptr)
+    return false;
+  print.first -= removed->print.first;
+  print.second -= removed->print.second;
+  count--;
+  root = std::move (updated);
+  return true;
+}
@@ -0,0 +1,81 @@
+/*************************************************************************
+ * comments.cc - This file is part of zcpp.                              *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <climits>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include "zcpp.hh"
+
+/* Strips comments from short inputs and compares the result with what
+   is expected, for cases where a quote is easy to take for the start of
+   a character literal */
+
+class strip_case
+{
+public:
+  const char *input;
+  const char *expected;
+};
+
+static const strip_case cases[] = {
+  /* Digit separator */
+  {"int x = 1'000; /* old code:\n#include \"gone.h\"\n*/\nint y;\n",
+   "int x = 1'000;             \n                 \n  \nint y;\n"},
+  {"int x = 0x1'ff; // '\nint y;\n",
+   "int x = 0x1'ff; // '\nint y;\n"},
+
+  /* Apostrophe in text */
+  {"#warning don't /* x */ y\n",
+   "#warning don't         y\n"},
+
+  /* Quote that is not closed on its line */
+  {"int z = ' /* c */;\nint w;\n",
+   "int z = '        ;\nint w;\n"},
+
+  /* Literals that are still recognized */
+  {"char c = '/'; /* d */\n",
+   "char c = '/';        \n"},
+  {"char c = '\\''; /* d */\n",
+   "char c = '\\'';        \n"},
+  {"char q = L'\"'; /* d */\nint v;\n",
+   "char q = L'\"';        \nint v;\n"},
+  {"char w = u8'/'/* e */;\n",
+   "char w = u8'/'       ;\n"},
+};
+
+int
+main (void)
+{
+  int failed = 0;
+  for (const strip_case &c : cases)
+    {
+      std::istringstream file (c.input);
+      zcpp::translation_unit unit ("<test>", file);
+      zcpp::comment_stripper stripper (unit, true);
+      std::string result;
+      stripper.run (result, SIZE_MAX);
+      if (result != c.expected)
+	{
+	  std::printf ("input:\n%s\nexpected:\n%s\ngot:\n%s\n", c.input,
+		       c.expected, result.c_str ());
+	  failed = 1;
+	}
+    }
+  return failed;
+}
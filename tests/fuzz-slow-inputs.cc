@@ -0,0 +1,83 @@
+/*************************************************************************
+ * fuzz-slow-inputs.cc - This file is part of zcpp.                      *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include "harness.hh"
+#include "zcpp.hh"
+
+/* libFuzzer target that looks for inputs which are slow to preprocess
+   for their size. The cost per byte of each input is passed back to the
+   fuzzer as a counter for its range, four to each power of two, so that
+   an input reaching a higher cost counts as new coverage and is kept.
+
+   Inputs costing more per byte than $ZCPP_SLOW_BUDGET are saved in
+   $ZCPP_SLOW_DIR, or slow-inputs, named by their hash. Once the cause is
+   fixed, a small reproducer belongs in tests/slow-inputs, where the
+   slow-inputs test replays it, or a generator in tests/generate.cc if
+   the cost grows with the size of the input. */
+
+__attribute__ ((section ("__libfuzzer_extra_counters")))
+static std::uint8_t cost_counters[65 * 4];
+
+static std::uint64_t budget;
+static std::string slow_dir = "slow-inputs";
+
+extern "C" int
+LLVMFuzzerInitialize (int *, char ***)
+{
+  harness::init ();
+  if (const char *s = std::getenv ("ZCPP_SLOW_BUDGET"))
+    budget = std::strtoull (s, nullptr, 10);
+  if (const char *s = std::getenv ("ZCPP_SLOW_DIR"))
+    slow_dir = s;
+  return 0;
+}
+
+static void
+save (std::string_view input, std::uint64_t per_byte)
+{
+  zcpp::hash h;
+  h.update (input.data (), input.size ());
+  std::string filename = slow_dir + '/' + h.hex ();
+  std::ofstream out (filename, std::ios::binary);
+  out.write (input.data (), input.size ());
+  if (out)
+    std::fprintf (stderr, "%llu %s per byte: saved %s\n",
+		  (unsigned long long) per_byte, harness::cost_unit (),
+		  filename.c_str ());
+  else
+    std::fprintf (stderr, "failed to save slow input %s\n",
+		  filename.c_str ());
+}
+
+extern "C" int
+LLVMFuzzerTestOneInput (const std::uint8_t *data, std::size_t size)
+{
+  std::string_view input ((const char *) data, size);
+  std::uint64_t per_byte =
+    harness::cost_per_byte (harness::run (input), size);
+  int bits = 64 - __builtin_clzll (per_byte | 1);
+  int quarter = bits < 3 ? 0 : per_byte >> (bits - 3) & 3;
+  cost_counters[bits * 4 + quarter] = 1;
+  if (budget > 0 && per_byte > budget)
+    save (input, per_byte);
+  return 0;
+}
@@ -0,0 +1,127 @@
+/*************************************************************************
+ * generate.cc - This file is part of zcpp.                              *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include "generate.hh"
+
+std::ostream &
+generate::directory::create (const std::string &name)
+{
+  file.close ();
+  file.open (path + '/' + name);
+  return file;
+}
+
+std::ostream &
+generate::overlay::create (const std::string &name)
+{
+  files.emplace_back (name, std::ostringstream ());
+  return files.back ().second;
+}
+
+std::string
+generate::overlay::str (void) const
+{
+  std::string result;
+  for (const std::pair <std::string, std::ostringstream> &file : files)
+    {
+      std::string contents = file.second.str ();
+      result += file.first + '\n' + std::to_string (contents.size ())
+	+ '\n' + contents;
+    }
+  return result;
+}
+
+void
+generate::many_macros (output &out, unsigned long n)
+{
+  std::ostream &file = out.create ("main.c");
+  for (unsigned long i = 0; i < n; i++)
+    file << "#define M" << i << ' ' << i << '\n';
+  for (unsigned long i = 0; i < n; i++)
+    file << 'M' << i << '\n';
+}
+
+void
+generate::many_params (output &out, unsigned long n)
+{
+  std::ostream &file = out.create ("main.c");
+  file << "#define F(p0";
+  for (unsigned long i = 1; i < n; i++)
+    file << ", p" << i;
+  file << ") p0";
+  for (unsigned long i = 1; i < n; i++)
+    file << " p" << i;
+  file << "\nF(0";
+  for (unsigned long i = 1; i < n; i++)
+    file << ", " << i;
+  file << ")\n";
+}
+
+void
+generate::long_argument (output &out, unsigned long n)
+{
+  std::ostream &file = out.create ("main.c");
+  file << "#define F(x) x\nF(a";
+  for (unsigned long i = 1; i < n; i++)
+    file << "+a";
+  file << ")\n";
+}
+
+void
+generate::include_depth (output &out, unsigned long n)
+{
+  out.create ("main.c") << "#include \"0.h\"\n";
+  for (unsigned long i = 0; i < n; i++)
+    {
+      std::ostream &file = out.create (std::to_string (i) + ".h");
+      if (i + 1 < n)
+	file << "#include \"" << i + 1 << ".h\"\n";
+      file << "int x" << i << ";\n";
+    }
+}
+
+void
+generate::if_nesting (output &out, unsigned long n)
+{
+  std::ostream &file = out.create ("main.c");
+  for (unsigned long i = 0; i < n; i++)
+    file << "#if 1\n";
+  file << "x\n";
+  for (unsigned long i = 0; i < n; i++)
+    file << "#endif\n";
+}
+
+void
+generate::long_line (output &out, unsigned long n)
+{
+  std::ostream &file = out.create ("main.c");
+  file << "#define A b\n";
+  for (unsigned long i = 0; i < n; i++)
+    file << "A ";
+  file << '\n';
+}
+
+void
+generate::defined_operands (output &out, unsigned long n)
+{
+  std::ostream &file = out.create ("main.c");
+  file << "#if defined (D0)";
+  for (unsigned long i = 1; i < n; i++)
+    file << " || defined (D" << i << ')';
+  file << "\nx\n#endif\n";
+}
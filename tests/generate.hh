@@ -0,0 +1,78 @@
+/*************************************************************************
+ * generate.hh - This file is part of zcpp.                              *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#ifndef _GENERATE_HH
+#define _GENERATE_HH
+
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+
+/* Inputs that stress one dimension of the preprocessor at a time, made
+   from a size so that the tests can build them at whatever size they
+   need instead of keeping copies. The first file of an input is main.c,
+   the one preprocessed. */
+
+namespace generate
+{
+  /* Where the files of an input go */
+  class output
+  {
+  public:
+    virtual ~output (void) = default;
+
+    /* Starts a file, written through the returned stream */
+    virtual std::ostream &create (const std::string &name) = 0;
+  };
+
+  /* Files on the disk, written as they are generated so that the size
+     of an input does not add to the memory used by the test */
+  class directory : public output
+  {
+  public:
+    explicit directory (std::string path) : path (std::move (path)) {}
+    std::ostream &create (const std::string &name) override;
+
+  private:
+    std::string path;
+    std::ofstream file;
+  };
+
+  /* An overlay file, as the harness takes it */
+  class overlay : public output
+  {
+  public:
+    std::ostream &create (const std::string &name) override;
+    std::string str (void) const;
+
+  private:
+    std::deque <std::pair <std::string, std::ostringstream>> files;
+  };
+
+  void many_macros (output &out, unsigned long n);
+  void many_params (output &out, unsigned long n);
+  void long_argument (output &out, unsigned long n);
+  void include_depth (output &out, unsigned long n);
+  void if_nesting (output &out, unsigned long n);
+  void long_line (output &out, unsigned long n);
+  void defined_operands (output &out, unsigned long n);
+}
+
+#endif
@@ -0,0 +1,136 @@
+/*************************************************************************
+ * harness.cc - This file is part of zcpp.                               *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <cerrno>
+#include <ctime>
+#include <iostream>
+#include <unistd.h>
+#include "harness.hh"
+#include "zcpp.hh"
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+/* The file system under every input, which has no files */
+class empty_vfs : public zcpp::vfs
+{
+public:
+  std::unique_ptr <std::istream>
+  open (const std::string &) override
+  {
+    errno = ENOENT;
+    return nullptr;
+  }
+
+  bool
+  is_file (const std::string &) override
+  {
+    return false;
+  }
+};
+
+static empty_vfs empty;
+static int counter = -1; /* Instructions retired by this thread */
+
+void
+harness::init (void)
+{
+  zcpp::filestack.push
+    (std::make_unique <zcpp::translation_unit> ("<command-line>", std::cin));
+  zcpp::includes.emplace_back (".", zcpp::include::quote);
+  zcpp::silence_diagnostics ();
+
+  /* Work done on other threads would not be counted */
+  zcpp::prefetch_threads = 0;
+  zcpp::strip_threads = 1;
+
+  /* Inputs that expand without bound are cut off well before they run
+     out of memory */
+  zcpp::max_output = 16 * 1024 * 1024;
+  zcpp::max_expansion = 1024 * 1024;
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  perf_event_attr attr = {};
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof attr;
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  counter = syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+const char *
+harness::cost_unit (void)
+{
+  return counter < 0 ? "ns" : "instructions";
+}
+
+static std::uint64_t
+now (void)
+{
+  if (counter >= 0)
+    {
+      std::uint64_t count;
+      if (read (counter, &count, sizeof count) == sizeof count)
+	return count;
+    }
+  timespec ts;
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * UINT64_C (1000000000) + ts.tv_nsec;
+}
+
+std::uint64_t
+harness::run (std::string_view input)
+{
+  zcpp::overlay_vfs bundle (empty);
+  zcpp::overlay_vfs single (empty);
+  std::string filename;
+  zcpp::files = &bundle;
+  if (!zcpp::parse_overlay (input, bundle, &filename) || filename.empty ())
+    {
+      filename = "fuzz.c";
+      single.add (filename, input);
+      zcpp::files = &single;
+    }
+  std::unique_ptr <std::istream> file = zcpp::files->open (filename);
+
+  zcpp::defines = zcpp::macro_table ();
+  zcpp::exiting = false;
+  zcpp::start_budget ();
+  zcpp::forget_conditions ();
+  zcpp::forget_includes ();
+  zcpp::forget_regions ();
+  zcpp::embedded.clear ();
+  std::uint64_t start = now ();
+  try
+    {
+      std::string result;
+      zcpp::preprocess (result, filename, *file);
+    }
+  catch (const zcpp::fatal_error &)
+    {
+      zcpp::abandon_files ();
+    }
+  zcpp::flush_diagnostics ();
+  std::uint64_t cost = now () - start;
+  zcpp::files = nullptr;
+  return cost;
+}
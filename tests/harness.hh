@@ -0,0 +1,54 @@
+/*************************************************************************
+ * harness.hh - This file is part of zcpp.                               *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#ifndef _HARNESS_HH
+#define _HARNESS_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/* Preprocesses inputs held in memory one after another in the same
+   process, as the fuzz target and the slow input runner do. An input is
+   an overlay file whose first file is the one preprocessed, or if it is
+   not one, a single file named fuzz.c. Nothing is read from the disk and
+   no messages are written. */
+
+namespace harness
+{
+  void init (void);
+
+  /* "instructions" where the processor counts them, or "ns" of CPU
+     time otherwise */
+  const char *cost_unit (void);
+
+  /* Returns what preprocessing the input cost */
+  std::uint64_t run (std::string_view input);
+
+  /* Inputs are charged for at least this many bytes, so that the fixed
+     cost of a run does not make the smallest ones look slow */
+  constexpr std::size_t min_size = 64;
+
+  inline std::uint64_t
+  cost_per_byte (std::uint64_t cost, std::size_t size)
+  {
+    return cost / (size < min_size ? min_size : size);
+  }
+}
+
+#endif
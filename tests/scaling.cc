@@ -0,0 +1,240 @@
+/*************************************************************************
+ * scaling.cc - This file is part of zcpp.                               *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <spawn.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include "generate.hh"
+
+/* Generates inputs that stress one dimension at a time at doubling
+   sizes, runs zcpp on each and fits the growth of its CPU time and peak
+   memory to a power of the size. A dimension fails if either grows
+   faster than SCALING_MAX_EXPONENT, which leaves room for n log n and
+   cache effects but not for anything quadratic. */
+
+#define SCALING_MAX_EXPONENT 1.6
+#define SCALING_STEPS 4
+#define SCALING_REPS 5
+
+/* Growth in memory below this many kilobytes is too small to fit */
+#define SCALING_MIN_MEMORY 4096
+
+extern char **environ;
+
+class measurement
+{
+public:
+  double seconds;
+  long kilobytes;
+};
+
+static const struct
+{
+  const char *name;
+  void (*generate) (generate::output &, unsigned long);
+  unsigned long first; /* Smallest size, large enough to time */
+} dimensions[] = {
+  {"macros", generate::many_macros, 20000},
+  {"parameters", generate::many_params, 8000},
+  {"argument length", generate::long_argument, 1000000},
+  {"include depth", generate::include_depth, 500},
+  {"#if nesting", generate::if_nesting, 40000},
+  {"line length", generate::long_line, 200000},
+  {"defined operands", generate::defined_operands, 8000}
+};
+
+/* Runs zcpp on dir/main.c once, or returns false if it fails */
+static bool
+run_once (const char *zcpp, const std::string &dir, unsigned long depth,
+	  measurement &m)
+{
+  std::string depth_arg = "-fmax-include-depth=" + std::to_string (depth);
+  std::string input = dir + "/main.c";
+  char *argv[] = {const_cast <char *> (zcpp), depth_arg.data (),
+		  input.data (), nullptr};
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_addopen (&actions, STDOUT_FILENO, "/dev/null",
+				    O_WRONLY, 0);
+  pid_t pid;
+  int err = posix_spawn (&pid, zcpp, &actions, nullptr, argv, environ);
+  posix_spawn_file_actions_destroy (&actions);
+  if (err != 0)
+    {
+      errno = err;
+      return false;
+    }
+  int status;
+  struct rusage usage;
+  if (wait4 (pid, &status, 0, &usage) < 0)
+    return false;
+  m.seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+    + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+  m.kilobytes = usage.ru_maxrss;
+  return WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+/* The least time and memory of several runs, since noise only adds */
+static bool
+run (const char *zcpp, const std::string &dir, unsigned long depth,
+     measurement &best)
+{
+  for (int i = 0; i < SCALING_REPS; i++)
+    {
+      measurement m;
+      if (!run_once (zcpp, dir, depth, m))
+	return false;
+      if (i == 0 || m.seconds < best.seconds)
+	best.seconds = m.seconds;
+      if (i == 0 || m.kilobytes < best.kilobytes)
+	best.kilobytes = m.kilobytes;
+    }
+  return true;
+}
+
+static void
+clear (const std::string &dir)
+{
+  std::remove ((dir + "/main.c").c_str ());
+  for (unsigned long i = 0; ; i++)
+    if (std::remove ((dir + '/' + std::to_string (i) + ".h").c_str ()) < 0)
+      break;
+}
+
+/* Slope of the least squares line through (log size, log cost) */
+static double
+exponent (const std::vector <double> &sizes,
+	  const std::vector <double> &costs)
+{
+  double sx = 0;
+  double sy = 0;
+  double sxx = 0;
+  double sxy = 0;
+  std::size_t n = sizes.size ();
+  for (std::size_t i = 0; i < n; i++)
+    {
+      double x = std::log (sizes[i]);
+      double y = std::log (costs[i]);
+      sx += x;
+      sy += y;
+      sxx += x * x;
+      sxy += x * y;
+    }
+  return (n * sxy - sx * sy) / (n * sxx - sx * sx);
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc != 2)
+    {
+      std::fprintf (stderr, "Usage: %s ZCPP\n", argv[0]);
+      return 2;
+    }
+  char dir_template[] = "/tmp/zcpp-scaling-XXXXXX";
+  const char *tmp = mkdtemp (dir_template);
+  if (!tmp)
+    {
+      std::perror ("mkdtemp");
+      return 2;
+    }
+  std::string dir (tmp);
+
+  /* Startup costs are taken off every measurement so that only the
+     work that depends on the size is fitted */
+  measurement base;
+  std::ofstream (dir + "/main.c") << "x\n";
+  errno = 0;
+  if (!run (argv[1], dir, 200, base))
+    {
+      std::fprintf (stderr, "%s: failed to run %s: %s\n", argv[0], argv[1],
+		    errno ? std::strerror (errno) : "it exited with an error");
+      clear (dir);
+      rmdir (dir.c_str ());
+      return 1;
+    }
+
+  int failed = 0;
+  for (const auto &d : dimensions)
+    {
+      bool ok = true;
+      std::vector <double> sizes;
+      std::vector <double> times;
+      std::vector <double> memory;
+      unsigned long n = d.first;
+      std::printf ("%s:\n", d.name);
+      for (int step = 0; step < SCALING_STEPS; step++, n *= 2)
+	{
+	  {
+	    generate::directory out (dir);
+	    d.generate (out, n);
+	  }
+	  measurement m;
+	  ok = run (argv[1], dir, n + 10, m);
+	  clear (dir);
+	  if (!ok)
+	    {
+	      std::fprintf (stderr, "%s: %s with size %lu failed\n", argv[0],
+			    d.name, n);
+	      break;
+	    }
+	  std::printf ("  %10lu  %8.3f s  %8ld kB\n", n, m.seconds,
+		       m.kilobytes);
+	  sizes.push_back (n);
+	  times.push_back (std::max (m.seconds - base.seconds, 1e-4));
+	  memory.push_back (std::max (m.kilobytes - base.kilobytes, 1L));
+	}
+      if (!ok)
+	{
+	  failed++;
+	  continue;
+	}
+
+      double time_growth = exponent (sizes, times);
+      bool time_ok = time_growth <= SCALING_MAX_EXPONENT;
+      std::printf ("  time grows as n^%.2f%s\n", time_growth,
+		   time_ok ? "" : ", which is too fast");
+      bool memory_ok = true;
+      if (memory.back () >= SCALING_MIN_MEMORY)
+	{
+	  double memory_growth = exponent (sizes, memory);
+	  memory_ok = memory_growth <= SCALING_MAX_EXPONENT;
+	  std::printf ("  memory grows as n^%.2f%s\n", memory_growth,
+		       memory_ok ? "" : ", which is too fast");
+	}
+      if (!time_ok || !memory_ok)
+	failed++;
+    }
+  clear (dir);
+  rmdir (dir.c_str ());
+  if (failed)
+    std::printf ("%d of %zu dimensions failed\n", failed,
+		 sizeof dimensions / sizeof *dimensions);
+  return failed ? 1 : 0;
+}
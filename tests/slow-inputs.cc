@@ -0,0 +1,146 @@
+/*************************************************************************
+ * slow-inputs.cc - This file is part of zcpp.                           *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "generate.hh"
+#include "harness.hh"
+
+/* Preprocesses inputs that were once slow, generated ones and any given
+   on the command line such as those saved by the fuzz target, and fails
+   if any executes more instructions per byte than its budget. CPU time
+   depends too much on the machine and the build to hold to a fixed
+   budget, so where instructions are not counted the costs are only
+   printed, and a run with a budget is skipped. */
+
+#define SLOW_REPS 5
+
+/* Exit status that tells meson the test was skipped */
+#define SLOW_SKIPPED 77
+
+/* Generated inputs, at sizes where they used to be slow */
+static const struct
+{
+  const char *name;
+  void (*generate) (generate::output &, unsigned long);
+  unsigned long size;
+} generated[] = {
+  {"defined-operands", generate::defined_operands, 6000},
+  {"include-chain", generate::include_depth, 150},
+  {"long-argument", generate::long_argument, 20000},
+  {"many-macros", generate::many_macros, 2000},
+  {"many-params", generate::many_params, 2000},
+  {"nested-if", generate::if_nesting, 3000}
+};
+
+/* Returns true if the input costs more per byte than the budget */
+static bool
+over_budget (const std::string &name, const std::string &input,
+	     std::uint64_t budget)
+{
+  /* Noise only adds to the cost */
+  std::uint64_t cost = harness::run (input);
+  for (int i = 1; i < SLOW_REPS; i++)
+    cost = std::min (cost, harness::run (input));
+  std::uint64_t per_byte = harness::cost_per_byte (cost, input.size ());
+  bool slow = budget > 0 && per_byte > budget;
+  std::printf ("%-32s %8llu %s per byte%s\n", name.c_str (),
+	       (unsigned long long) per_byte, harness::cost_unit (),
+	       slow ? ", over budget" : "");
+  return slow;
+}
+
+static bool
+number (const char *arg, const char *flag, std::uint64_t &value)
+{
+  std::size_t len = std::strlen (flag);
+  if (std::strncmp (arg, flag, len) != 0)
+    return false;
+  char *end;
+  value = std::strtoull (arg + len, &end, 10);
+  return *end == '\0' && end != arg + len;
+}
+
+int
+main (int argc, char **argv)
+{
+  std::uint64_t budget = 0;
+  std::vector <std::filesystem::path> inputs;
+  for (int i = 1; i < argc; i++)
+    {
+      if (number (argv[i], "--max-instructions=", budget))
+	continue;
+      if (argv[i][0] == '-')
+	{
+	  std::fprintf (stderr, "Usage: %s [--max-instructions=N] "
+			"[FILE|DIR]...\n", argv[0]);
+	  return 2;
+	}
+      std::error_code ec;
+      if (std::filesystem::is_directory (argv[i], ec))
+	{
+	  std::vector <std::filesystem::path> files;
+	  for (const std::filesystem::directory_entry &entry
+		 : std::filesystem::directory_iterator (argv[i], ec))
+	    files.push_back (entry.path ());
+	  std::sort (files.begin (), files.end ());
+	  inputs.insert (inputs.end (), files.begin (), files.end ());
+	}
+      else
+	inputs.emplace_back (argv[i]);
+    }
+
+  harness::init ();
+  if (budget > 0 && std::strcmp (harness::cost_unit (), "ns") == 0)
+    {
+      std::printf ("instructions cannot be counted here, skipping\n");
+      return SLOW_SKIPPED;
+    }
+  int failed = 0;
+  for (const auto &g : generated)
+    {
+      generate::overlay out;
+      g.generate (out, g.size);
+      failed += over_budget (g.name, out.str (), budget);
+    }
+  for (const std::filesystem::path &path : inputs)
+    {
+      std::ifstream file (path, std::ios::binary);
+      if (!file)
+	{
+	  std::fprintf (stderr, "%s: failed to open %s\n", argv[0],
+			path.c_str ());
+	  failed++;
+	  continue;
+	}
+      std::string input ((std::istreambuf_iterator <char> (file)),
+			 std::istreambuf_iterator <char> ());
+      failed += over_budget (path.filename (), input, budget);
+    }
+  if (failed)
+    std::printf ("%d of %zu inputs failed\n", failed,
+		 std::size (generated) + inputs.size ());
+  return failed ? 1 : 0;
+}
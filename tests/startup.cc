@@ -0,0 +1,137 @@
+/*************************************************************************
+ * startup.cc - This file is part of zcpp.                               *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <spawn.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+/* Runs zcpp many times on a tiny input and reports the time from
+   starting it to the first byte of its output, and to its exit. This
+   is what a build that runs it once per file waits for when the files
+   are small. */
+
+#define STARTUP_RUNS 200
+
+static const char input[] = "#define TINY 1\nint x = TINY;\n";
+
+typedef std::chrono::steady_clock timer;
+
+extern char **environ;
+
+static bool
+run_once (const char *zcpp, double &first_byte, double &exited)
+{
+  int in[2];
+  int out[2];
+  if (pipe (in) < 0 || pipe (out) < 0)
+    return false;
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_adddup2 (&actions, in[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2 (&actions, out[1], STDOUT_FILENO);
+  posix_spawn_file_actions_addclose (&actions, in[1]);
+  posix_spawn_file_actions_addclose (&actions, out[0]);
+  char *argv[] = {const_cast <char *> (zcpp), nullptr};
+
+  timer::time_point start = timer::now ();
+  pid_t pid;
+  int err = posix_spawn (&pid, zcpp, &actions, nullptr, argv, environ);
+  posix_spawn_file_actions_destroy (&actions);
+  close (in[0]);
+  close (out[1]);
+  if (err != 0)
+    {
+      close (in[1]);
+      close (out[0]);
+      errno = err;
+      return false;
+    }
+
+  /* The input fits in the pipe, so this never waits for the child */
+  if (write (in[1], input, sizeof input - 1) < 0)
+    std::perror ("write");
+  close (in[1]);
+  char buffer[4096];
+  ssize_t n = read (out[0], buffer, sizeof buffer);
+  first_byte = std::chrono::duration <double, std::milli>
+    (timer::now () - start).count ();
+  while (n > 0)
+    n = read (out[0], buffer, sizeof buffer);
+  close (out[0]);
+  int status;
+  waitpid (pid, &status, 0);
+  exited = std::chrono::duration <double, std::milli>
+    (timer::now () - start).count ();
+  return WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+static void
+report (const char *what, std::vector <double> &times)
+{
+  std::sort (times.begin (), times.end ());
+  std::printf ("%-16s min %.3f ms, median %.3f ms, 90th percentile "
+	       "%.3f ms\n", what, times.front (), times[times.size () / 2],
+	       times[times.size () * 9 / 10]);
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc < 2 || argc > 3)
+    {
+      std::fprintf (stderr, "Usage: %s ZCPP [RUNS]\n", argv[0]);
+      return 2;
+    }
+  int runs = argc > 2 ? std::atoi (argv[2]) : STARTUP_RUNS;
+  if (runs <= 0)
+    {
+      std::fprintf (stderr, "%s: RUNS must be a positive number\n", argv[0]);
+      return 2;
+    }
+
+  std::vector <double> first_bytes;
+  std::vector <double> exits;
+  for (int i = 0; i < runs; i++)
+    {
+      double first_byte;
+      double exited;
+      errno = 0;
+      if (!run_once (argv[1], first_byte, exited))
+	{
+	  std::fprintf (stderr, "%s: failed to run %s: %s\n", argv[0],
+			argv[1], errno ? std::strerror (errno)
+			: "it exited with an error");
+	  return 1;
+	}
+      first_bytes.push_back (first_byte);
+      exits.push_back (exited);
+    }
+  std::printf ("%d runs of %s on a %zu-byte input\n", runs, argv[1],
+	       sizeof input - 1);
+  report ("First byte:", first_bytes);
+  report ("Exit:", exits);
+  return 0;
+}
@@ -0,0 +1,309 @@
+/*************************************************************************
+ * tokens.cc - This file is part of zcpp.                                *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <cctype>
+#include <cstring>
+#include <ostream>
+#include <unordered_map>
+#include "zcpp-tokens.h"
+#include "zcpp.hh"
+
+bool zcpp::emit_tokens;
+
+/* Punctuators longer than one character, longest first */
+
+static const char *punctuators[] = {
+  "%:%:", "...", "<<=", ">>=", "->*", "<=>", "->", "++", "--", "<<", ">>",
+  "<=", ">=", "==", "!=", "&&", "||", "*=", "/=", "%=", "+=", "-=", "&=",
+  "^=", "|=", "##", "::", ".*", "<:", ":>", "<%", "%>", "%:"
+};
+
+class token_writer
+{
+public:
+  std::vector <zcpp_string> strings;
+  std::vector <zcpp_token> tokens;
+  std::vector <zcpp_location> locations;
+  std::string data;
+
+  std::uint32_t
+  intern (std::string_view s)
+  {
+    std::pair <std::unordered_map <std::string_view, std::uint32_t>::iterator,
+	       bool> it = ids.emplace (s, strings.size ());
+    if (it.second)
+      {
+	if (data.size () + s.size () > UINT32_MAX)
+	  zcpp::fatal ("tokens are too long for the token stream");
+	strings.push_back ({(std::uint32_t) data.size (),
+			    (std::uint32_t) s.size ()});
+	data.append (s);
+      }
+    return it.first->second;
+  }
+
+private:
+  std::unordered_map <std::string_view, std::uint32_t> ids;
+};
+
+static bool
+is_ident (char c)
+{
+  return std::isalnum ((unsigned char) c) || c == '_' || c == '$';
+}
+
+static bool
+is_literal_prefix (std::string_view s)
+{
+  return s == "L" || s == "u" || s == "U" || s == "u8";
+}
+
+/* Returns the end of the quoted literal starting at pos. An unterminated
+   literal ends at the end of the line. */
+
+static std::size_t
+literal_end (std::string_view text, std::size_t pos)
+{
+  char quote = text[pos++];
+  while (pos < text.size () && text[pos] != quote && text[pos] != '\n')
+    pos += text[pos] == '\\' && pos + 1 < text.size () ? 2 : 1;
+  return pos < text.size () && text[pos] == quote ? pos + 1 : pos;
+}
+
+/* Finds the kind and end of the token starting at pos */
+
+static std::uint8_t
+scan_token (std::string_view text, std::size_t pos, std::size_t &end)
+{
+  char c = text[pos];
+  if (std::isdigit ((unsigned char) c)
+      || (c == '.' && pos + 1 < text.size ()
+	  && std::isdigit ((unsigned char) text[pos + 1])))
+    {
+      end = pos + 1;
+      while (end < text.size ())
+	{
+	  if ((text[end] == '+' || text[end] == '-')
+	      && std::strchr ("eEpP", text[end - 1]))
+	    end++;
+	  else if (is_ident (text[end]) || text[end] == '.')
+	    end++;
+	  else
+	    break;
+	}
+      return ZCPP_TOKEN_NUMBER;
+    }
+  if (is_ident (c))
+    {
+      end = pos + 1;
+      while (end < text.size () && is_ident (text[end]))
+	end++;
+      if (end < text.size () && (text[end] == '"' || text[end] == '\'')
+	  && is_literal_prefix (text.substr (pos, end - pos)))
+	{
+	  std::uint8_t kind =
+	    text[end] == '"' ? ZCPP_TOKEN_STRING : ZCPP_TOKEN_CHAR;
+	  end = literal_end (text, end);
+	  return kind;
+	}
+      return ZCPP_TOKEN_IDENTIFIER;
+    }
+  if (c == '"' || c == '\'')
+    {
+      end = literal_end (text, pos);
+      return c == '"' ? ZCPP_TOKEN_STRING : ZCPP_TOKEN_CHAR;
+    }
+  if (!std::ispunct ((unsigned char) c))
+    {
+      end = pos + 1;
+      return ZCPP_TOKEN_OTHER;
+    }
+  for (const char *p : punctuators)
+    {
+      if (text.compare (pos, std::strlen (p), p) == 0)
+	{
+	  end = pos + std::strlen (p);
+	  return ZCPP_TOKEN_PUNCTUATOR;
+	}
+    }
+  end = pos + 1;
+  return ZCPP_TOKEN_PUNCTUATOR;
+}
+
+/* If a line marker written by stamp_file starts at pos, sets line and
+   file to the position it gives for the following line and returns the
+   end of the marker line, otherwise returns npos */
+
+static std::size_t
+read_marker (std::string_view text, std::size_t pos, std::uint32_t &line,
+	     std::string_view &file)
+{
+  std::size_t i = pos + 1;
+  while (i < text.size () && (text[i] == ' ' || text[i] == '\t'))
+    i++;
+  if (i >= text.size () || !std::isdigit ((unsigned char) text[i]))
+    return std::string::npos;
+  std::uint32_t n = 0;
+  while (i < text.size () && std::isdigit ((unsigned char) text[i]))
+    n = n * 10 + text[i++] - '0';
+  while (i < text.size () && (text[i] == ' ' || text[i] == '\t'))
+    i++;
+  if (i < text.size () && text[i] == '"')
+    {
+      std::size_t close = text.find ('"', i + 1);
+      if (close == std::string::npos)
+	return std::string::npos;
+      file = text.substr (i + 1, close - i - 1);
+      i = close + 1;
+    }
+  line = n;
+  std::size_t end = text.find ('\n', i);
+  return end == std::string::npos ? text.size () : end;
+}
+
+/* If an #embed marker written by zcpp::embed starts at pos, sets resource
+   to the one it refers to and returns the end of the marker line,
+   otherwise returns npos */
+
+static std::size_t
+read_embed (std::string_view text, std::size_t pos,
+	    const zcpp::embed_resource *&resource)
+{
+  if (text.compare (pos, 7, "#embed ") != 0)
+    return std::string::npos;
+  std::size_t i = pos + 7;
+  if (i >= text.size () || !std::isdigit ((unsigned char) text[i]))
+    return std::string::npos;
+  std::size_t index = 0;
+  while (i < text.size () && std::isdigit ((unsigned char) text[i])
+	 && index < zcpp::embedded.size ())
+    index = index * 10 + text[i++] - '0';
+  if (index >= zcpp::embedded.size () || (i < text.size () && text[i] != '\n'))
+    return std::string::npos;
+  resource = zcpp::embedded[index].get ();
+  return i;
+}
+
+/* Writes preprocessed text as a token stream in the format described in
+   zcpp-tokens.h */
+
+void
+zcpp::write_tokens (std::string_view text, std::ostream &output)
+{
+  token_writer w;
+  std::uint32_t line = 1;
+  std::string_view file;
+  std::uint32_t last_line = 0;
+  std::uint32_t last_file = UINT32_MAX;
+  bool start = true;
+  bool space = false;
+  bool continued = false; /* Whether the last newline followed a token */
+  w.intern (file);
+
+  std::size_t i = 0;
+  while (i < text.size ())
+    {
+      char c = text[i];
+      if (c == '\n')
+	{
+	  continued = !start;
+	  line++;
+	  start = true;
+	  space = false;
+	  i++;
+	  continue;
+	}
+      if (std::isspace ((unsigned char) c))
+	{
+	  space = true;
+	  i++;
+	  continue;
+	}
+      std::size_t end;
+      std::uint8_t kind;
+      std::uint32_t spelling;
+      const zcpp::embed_resource *resource;
+      if (start && c == '#'
+	  && (end = read_embed (text, i, resource)) != std::string::npos)
+	{
+	  /* The marker sits on lines of its own that are not part of the
+	     source, so it continues the line of the directive */
+	  line--;
+	  start = !continued;
+	  space = continued;
+	  kind = ZCPP_TOKEN_EMBED;
+	  spelling = w.intern (resource->bytes);
+	  if (end < text.size ())
+	    end++;
+	}
+      else if (start && c == '#'
+	       && (end = read_marker (text, i, line, file))
+	       != std::string::npos)
+	{
+	  i = end + 1;
+	  space = false;
+	  continue;
+	}
+      else
+	{
+	  kind = scan_token (text, i, end);
+	  spelling = w.intern (text.substr (i, end - i));
+	}
+      if (w.strings.size () > ZCPP_TOKEN_MAX_SPELLING)
+	zcpp::fatal ("too many distinct tokens for the token stream");
+      zcpp_token token;
+      token.bits = spelling << ZCPP_TOKEN_SPELLING_SHIFT | kind |
+	(space ? ZCPP_TOKEN_LEADING_SPACE << 3 : 0) |
+	(start ? ZCPP_TOKEN_START_OF_LINE << 3 : 0);
+
+      /* Only record a location where it can't be worked out from the
+	 token before */
+      std::uint32_t file_id = w.intern (file);
+      if (file_id != last_file || line != last_line + (start ? 1 : 0))
+	w.locations.push_back ({(std::uint32_t) w.tokens.size (), line,
+				file_id});
+      last_line = line;
+      last_file = file_id;
+
+      w.tokens.push_back (token);
+      start = false;
+      space = false;
+      i = end;
+    }
+
+  zcpp_tokens_header header;
+  std::memcpy (header.magic, ZCPP_TOKENS_MAGIC, sizeof header.magic);
+  header.string_count = w.strings.size ();
+  header.token_count = w.tokens.size ();
+  header.location_count = w.locations.size ();
+  header.reserved = 0;
+  header.strings = sizeof header;
+  header.tokens = header.strings + w.strings.size () * sizeof (zcpp_string);
+  header.locations = header.tokens + w.tokens.size () * sizeof (zcpp_token);
+  header.data =
+    header.locations + w.locations.size () * sizeof (zcpp_location);
+
+  output.write ((const char *) &header, sizeof header);
+  output.write ((const char *) w.strings.data (),
+		w.strings.size () * sizeof (zcpp_string));
+  output.write ((const char *) w.tokens.data (),
+		w.tokens.size () * sizeof (zcpp_token));
+  output.write ((const char *) w.locations.data (),
+		w.locations.size () * sizeof (zcpp_location));
+  output.write (w.data.data (), w.data.size ());
+}
@@ -16,24 +16,27 @@
  * along with this program. If not, see <https://www.gnu.org/licenses/>. *
  *************************************************************************/
 
+#include <cstring>
 #include "zcpp.hh"
 
 bool
-zcpp::expect_read_identifier (std::string &result, const std::string &input,
+zcpp::expect_read_identifier (std::string &result, std::string_view input,
 			      std::size_t &pos, bool first_num,
 			      bool end_space, bool print_err)
 {
-  if (!std::isalpha (input[pos])
-      && (!first_num || !std::isdigit (input[pos])) && input[pos] != '_')
+  char c = pos < input.size () ? input[pos] : '\0';
+  if (!std::isalpha (c) && (!first_num || !std::isdigit (c)) && c != '_')
     {
       if (print_err)
 	zcpp::error (std::string ("expected identifier, got bad "
-				  "character: ") + input[pos]);
+				  "character: ") + c);
       return false;
     }
+  std::size_t start = pos;
   while (pos < input.size ()
 	 && (std::isalnum (input[pos]) || input[pos] == '_'))
-    result += input[pos++];
+    pos++;
+  result += input.substr (start, pos - start);
 
   if (end_space)
     {
@@ -53,10 +56,10 @@ zcpp::expect_read_identifier (std::string &result, const std::string &input,
 }
 
 void
-zcpp::expect_read_string (std::string &result, const std::string &input,
+zcpp::expect_read_string (std::string &result, std::string_view input,
 			  std::size_t &pos)
 {
-  if (input[pos] != '"')
+  if (pos >= input.size () || input[pos] != '"')
     {
       zcpp::error ("expected string literal");
       return;
@@ -109,3 +112,97 @@ zcpp::expect_read_string (std::string &result, const std::string &input,
   else
     pos++;
 }
+
+static inline std::uint64_t
+rotate (std::uint64_t x, int n)
+{
+  return (x << n) | (x >> (64 - n));
+}
+
+static inline std::uint64_t
+finalize (std::uint64_t x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+void
+zcpp::hash::mix (std::uint64_t word)
+{
+  a ^= rotate (word * 0x87c37b91114253d5ULL, 31) * 0x4cf5ad432745937fULL;
+  a = rotate (a, 27) * 5 + 0x52dce729;
+  b ^= rotate (word * 0x4cf5ad432745937fULL, 33) * 0x87c37b91114253d5ULL;
+  b = rotate (b, 31) + a;
+  b = b * 5 + 0x38495ab5;
+}
+
+void
+zcpp::hash::update (const char *data, std::size_t size)
+{
+  length += size;
+  while (used > 0 && size > 0)
+    {
+      buffer[used++] = *data++;
+      size--;
+      if (used == sizeof buffer)
+	{
+	  std::uint64_t word;
+	  std::memcpy (&word, buffer, sizeof word);
+	  mix (word);
+	  used = 0;
+	}
+    }
+  for (; size >= sizeof buffer; data += sizeof buffer, size -= sizeof buffer)
+    {
+      std::uint64_t word;
+      std::memcpy (&word, data, sizeof word);
+      mix (word);
+    }
+  std::memcpy (buffer + used, data, size);
+  used += size;
+}
+
+void
+zcpp::hash::update (const std::string &s)
+{
+  /* Include the length so that consecutive strings can't run together */
+  std::uint64_t size = s.size ();
+  update ((const char *) &size, sizeof size);
+  update (s.data (), s.size ());
+}
+
+std::pair <std::uint64_t, std::uint64_t>
+zcpp::hash::digest (void) const
+{
+  std::uint64_t x = a;
+  std::uint64_t y = b;
+  std::uint64_t word = 0;
+  std::memcpy (&word, buffer, used);
+  x ^= finalize (word ^ length);
+  y ^= length;
+  x += y;
+  y += x;
+  x = finalize (x);
+  y = finalize (y);
+  x += y;
+  y += x;
+  return std::make_pair (x, y);
+}
+
+std::string
+zcpp::hash::hex (void) const
+{
+  static const char digits[] = "0123456789abcdef";
+  std::pair <std::uint64_t, std::uint64_t> value = digest ();
+  std::string result;
+  for (std::uint64_t part : {value.first, value.second})
+    {
+      for (int i = 60; i >= 0; i -= 4)
+	result += digits[(part >> i) & 0xf];
+    }
+  return result;
+}
@@ -0,0 +1,240 @@
+/*************************************************************************
+ * vfs.cc - This file is part of zcpp.                                   *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "zcpp.hh"
+
+/* Reads memory in place. Seeking is supported so that stage 1 can find
+   the size of the input. */
+
+class memory_buffer : public std::streambuf
+{
+public:
+  explicit memory_buffer (std::string_view data)
+  {
+    char *p = const_cast <char *> (data.data ());
+    setg (p, p, p + data.size ());
+  }
+
+  /* Returns the bytes not read yet and marks them as read */
+  std::string_view
+  take (void)
+  {
+    std::string_view rest (gptr (), egptr () - gptr ());
+    setg (eback (), egptr (), egptr ());
+    return rest;
+  }
+
+protected:
+  pos_type
+  seekoff (off_type off, std::ios::seekdir dir,
+	   std::ios::openmode which) override
+  {
+    off_type base = dir == std::ios::beg ? 0
+      : dir == std::ios::cur ? gptr () - eback () : egptr () - eback ();
+    return seekpos (base + off, which);
+  }
+
+  pos_type
+  seekpos (pos_type pos, std::ios::openmode which) override
+  {
+    if (!(which & std::ios::in) || pos < 0 || pos > egptr () - eback ())
+      return pos_type (off_type (-1));
+    setg (eback (), eback () + pos, egptr ());
+    return pos;
+  }
+};
+
+class memory_stream : public std::istream
+{
+public:
+  explicit memory_stream (std::string_view data) : std::istream (nullptr),
+						   buffer (data)
+  {
+    rdbuf (&buffer);
+  }
+
+  std::string_view
+  take (void)
+  {
+    return buffer.take ();
+  }
+
+private:
+  memory_buffer buffer;
+};
+
+static zcpp::disk_vfs disk;
+zcpp::vfs *zcpp::files = &disk;
+
+std::unique_ptr <std::istream>
+zcpp::disk_vfs::open (const std::string &path)
+{
+  std::unique_ptr <std::istream> file =
+    std::make_unique <std::ifstream> (path);
+  if (!file->good ())
+    return nullptr;
+  return file;
+}
+
+bool
+zcpp::disk_vfs::is_file (const std::string &path)
+{
+  std::error_code ec;
+  return std::filesystem::is_regular_file (path, ec);
+}
+
+zcpp::overlay_vfs::overlay_vfs (vfs &lower) : lower (lower)
+{
+  std::error_code ec;
+  cwd = std::filesystem::current_path (ec).string ();
+}
+
+/* Files are found by their absolute path, so the same file can be named
+   relative to any directory. Working this out never touches the disk. */
+
+std::string
+zcpp::overlay_vfs::key (const std::string &path) const
+{
+  std::filesystem::path p (path);
+  if (p.is_relative ())
+    p = cwd / p;
+  return p.lexically_normal ().string ();
+}
+
+void
+zcpp::overlay_vfs::add (const std::string &path, std::string_view data)
+{
+  files[key (path)] = data;
+}
+
+std::unique_ptr <std::istream>
+zcpp::overlay_vfs::open (const std::string &path)
+{
+  std::string_view data;
+  if (view (path, data))
+    return std::make_unique <memory_stream> (data);
+  return lower.open (path);
+}
+
+bool
+zcpp::overlay_vfs::is_file (const std::string &path)
+{
+  std::string_view data;
+  return view (path, data) || lower.is_file (path);
+}
+
+bool
+zcpp::overlay_vfs::view (const std::string &path, std::string_view &data)
+{
+  std::map <std::string, std::string_view, std::less <>>::iterator it =
+    files.find (key (path));
+  if (it == files.end ())
+    return false;
+  data = it->second;
+  return true;
+}
+
+/* If the stream was opened from memory, sets data to the part of it not
+   read yet, which then counts as read */
+
+bool
+zcpp::memory_view (std::istream &file, std::string_view &data)
+{
+  memory_stream *stream = dynamic_cast <memory_stream *> (&file);
+  if (stream == nullptr)
+    return false;
+  data = stream->take ();
+  return true;
+}
+
+/* An overlay file holds any number of files, each written as its path
+   and its size in bytes on lines of their own followed by its contents.
+   The files are used where they are in data. Returns false if data does
+   not end after a whole file. */
+
+bool
+zcpp::parse_overlay (std::string_view data, zcpp::overlay_vfs &overlay,
+		     std::string *first)
+{
+  std::size_t pos = 0;
+  while (pos < data.size ())
+    {
+      std::size_t nl = data.find ('\n', pos);
+      std::size_t size_end =
+	nl == std::string_view::npos ? nl : data.find ('\n', nl + 1);
+      if (size_end == std::string_view::npos)
+	break;
+      std::string path (data.substr (pos, nl - pos));
+      std::string size (data.substr (nl + 1, size_end - nl - 1));
+      if (path.empty () || size.empty () || size.size () > 18
+	  || size.find_first_not_of ("0123456789") != std::string::npos)
+	break;
+      std::size_t length = std::stoull (size);
+      if (length > data.size () - size_end - 1)
+	break;
+      overlay.add (path, data.substr (size_end + 1, length));
+      if (pos == 0 && first != nullptr)
+	*first = path;
+      pos = size_end + 1 + length;
+    }
+  return pos == data.size ();
+}
+
+/* The overlay file is read once, or mapped */
+
+bool
+zcpp::load_overlay (const std::string &filename)
+{
+  static std::deque <std::string> read;
+  static std::deque <zcpp::embed_resource> mapped;
+  std::string_view data;
+  if (filename == "-")
+    {
+      std::ostringstream stream;
+      stream << std::cin.rdbuf ();
+      data = read.emplace_back (stream.str ());
+    }
+  else
+    {
+      const zcpp::embed_resource &file =
+	mapped.emplace_back (filename, UINTMAX_MAX);
+      if (!file.good)
+	{
+	  zcpp::error ("failed to open overlay file " + zcpp::bold (filename) +
+		       ": " + std::strerror (errno));
+	  return false;
+	}
+      data = file.bytes;
+    }
+
+  static zcpp::overlay_vfs overlay (disk);
+  if (!zcpp::parse_overlay (data, overlay))
+    {
+      zcpp::error ("malformed overlay file " + zcpp::bold (filename));
+      return false;
+    }
+  zcpp::files = &overlay;
+  return true;
+}
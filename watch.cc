@@ -0,0 +1,277 @@
+/*************************************************************************
+ * watch.cc - This file is part of zcpp.                                 *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include "zcpp.hh"
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+/* Time to wait for more changes after one is seen, in milliseconds */
+#define WATCH_SETTLE 20
+
+bool zcpp::watching;
+std::vector <zcpp::checkpoint> zcpp::checkpoints;
+
+/* Every file read during the last run, with the number of checkpoints
+   that existed when it was opened. Zero means a change to the file needs
+   a full restart, otherwise the run resumes from the checkpoint before
+   that number. */
+static std::vector <std::pair <std::string, std::size_t>> deps;
+static std::map <std::string, std::string> stage1_cache;
+
+static std::string
+normalize (const std::string &filename)
+{
+  return std::filesystem::path (filename).lexically_normal ().string ();
+}
+
+void
+zcpp::watch_dependency (const std::string &filename)
+{
+  deps.emplace_back (normalize (filename), zcpp::checkpoints.size ());
+}
+
+std::string *
+zcpp::watch_file (const std::string &filename)
+{
+  zcpp::watch_dependency (filename);
+  return &stage1_cache[filename];
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+static int inotify_fd = -1;
+static std::map <int, std::string> watch_dirs;
+static std::set <std::string> watched;
+
+static void
+watch_deps (void)
+{
+  for (const std::pair <std::string, std::size_t> &dep : deps)
+    {
+      std::string dir = std::filesystem::path (dep.first).parent_path ();
+      if (dir.empty ())
+	dir = ".";
+
+      /* Headers that are missing are often missing whole directories */
+      std::error_code ec;
+      if (!std::filesystem::is_directory (dir, ec))
+	continue;
+      if (!watched.insert (dir).second)
+	continue;
+      int wd = inotify_add_watch (inotify_fd, dir.c_str (),
+				  IN_CLOSE_WRITE | IN_MOVED_TO);
+      if (wd < 0)
+	zcpp::warning ("failed to watch " + zcpp::bold (dir) + ": " +
+		       std::strerror (errno));
+      else
+	watch_dirs[wd] = dir;
+    }
+}
+
+static void
+read_changes (std::set <std::string> &changed)
+{
+  alignas (struct inotify_event) char buffer[4096];
+  ssize_t len = read (inotify_fd, buffer, sizeof buffer);
+  for (ssize_t i = 0; i < len; )
+    {
+      struct inotify_event *event = (struct inotify_event *) (buffer + i);
+      i += sizeof (struct inotify_event) + event->len;
+      std::map <int, std::string>::iterator it = watch_dirs.find (event->wd);
+      if (it == watch_dirs.end () || event->len == 0)
+	continue;
+      std::string path (event->name);
+      if (it->second != ".")
+	path = it->second + '/' + path;
+      changed.insert (normalize (path));
+    }
+}
+
+/* Blocks until a file used by the last run changes and returns the number
+   of the first checkpoint that is no longer valid */
+
+static std::size_t
+wait_for_change (void)
+{
+  while (true)
+    {
+      std::set <std::string> changed;
+      read_changes (changed);
+      struct pollfd pfd = {inotify_fd, POLLIN, 0};
+      while (poll (&pfd, 1, WATCH_SETTLE) > 0)
+	read_changes (changed);
+
+      std::size_t restart = SIZE_MAX;
+      for (const std::pair <std::string, std::size_t> &dep : deps)
+	{
+	  if (dep.second < restart && changed.count (dep.first))
+	    restart = dep.second;
+	}
+      for (const std::string &filename : changed)
+	{
+	  std::map <std::string, std::string>::iterator it =
+	    stage1_cache.begin ();
+	  while (it != stage1_cache.end ())
+	    {
+	      if (normalize (it->first) == filename)
+		it = stage1_cache.erase (it);
+	      else
+		it++;
+	    }
+	}
+      if (restart != SIZE_MAX)
+	return restart;
+    }
+}
+
+static std::string
+run (const std::string &filename, std::size_t restart,
+     const zcpp::macro_table &baseline, const std::string &previous)
+{
+  zcpp::exiting = false;
+  zcpp::start_budget ();
+  zcpp::forget_includes ();
+  if (restart == 0)
+    {
+      deps.clear ();
+      zcpp::checkpoints.clear ();
+      zcpp::embedded.clear ();
+      zcpp::defines = baseline;
+      std::unique_ptr <std::istream> file = zcpp::files->open (filename);
+      if (file == nullptr)
+	{
+	  zcpp::error ("failed to open input file " + zcpp::bold (filename) +
+		       ": " + std::strerror (errno));
+	  return std::string ();
+	}
+      return zcpp::preprocess (filename, *file);
+    }
+
+  zcpp::checkpoint from = zcpp::checkpoints[restart - 1];
+  zcpp::checkpoints.resize (restart - 1);
+  std::vector <std::pair <std::string, std::size_t>>::iterator it =
+    deps.begin ();
+  while (it != deps.end ())
+    {
+      if (it->second >= restart)
+	it = deps.erase (it);
+      else
+	it++;
+    }
+
+  std::istringstream empty;
+  zcpp::filestack.push (std::make_unique <zcpp::translation_unit> (filename,
+								   empty));
+  zcpp::filestack.top ()->output = stage1_cache[filename];
+  std::string result =
+    zcpp::resume_directives (from, previous.substr (0, from.length));
+  zcpp::filestack.pop ();
+  return result;
+}
+
+static void
+write_output (const std::string &outname, const std::string &result)
+{
+  std::ofstream output (outname, std::ios::binary);
+  if (zcpp::emit_tokens)
+    zcpp::write_tokens (result, output);
+  else
+    output << result;
+  if (!output.good ())
+    zcpp::error ("failed to write output file " + zcpp::bold (outname) +
+		 ": " + std::strerror (errno));
+}
+
+int
+zcpp::watch (const std::string &filename, const std::string &outname)
+{
+  zcpp::macro_table baseline = zcpp::defines;
+  std::string previous;
+  std::size_t restart = 0;
+
+  /* A header that was read ahead but never used could be stale by the
+     time a later run needs it */
+  zcpp::prefetch_threads = 0;
+  zcpp::watching = true;
+  inotify_fd = inotify_init1 (IN_CLOEXEC);
+  if (inotify_fd < 0)
+    {
+      zcpp::error (std::string ("failed to initialize inotify: ") +
+		   std::strerror (errno));
+      return 1;
+    }
+
+  while (true)
+    {
+      std::chrono::steady_clock::time_point start =
+	std::chrono::steady_clock::now ();
+      std::string result;
+      try
+	{
+	  /* A limit that is hit only fails this run */
+	  result = run (filename, restart, baseline, previous);
+	  if (!zcpp::exiting)
+	    write_output (outname, result);
+	}
+      catch (const zcpp::fatal_error &)
+	{
+	  zcpp::abandon_files ();
+	}
+      zcpp::flush_diagnostics ();
+      if (zcpp::exiting)
+	{
+	  /* Partial output can't be resumed from */
+	  restart = 0;
+	  previous.clear ();
+	}
+      else
+	previous = std::move (result);
+      if (zcpp::verbose)
+	std::cerr << "Updated " << outname << " in "
+		  << std::chrono::duration_cast <std::chrono::milliseconds>
+		       (std::chrono::steady_clock::now () - start).count ()
+		  << " ms" << std::endl;
+
+      watch_deps ();
+      std::size_t changed = wait_for_change ();
+      if (!previous.empty ())
+	restart = changed;
+    }
+}
+
+#else
+
+int
+zcpp::watch (const std::string &, const std::string &)
+{
+  zcpp::error ("watching files is not supported on this system");
+  return 1;
+}
+
+#endif
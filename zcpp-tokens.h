@@ -0,0 +1,176 @@
+/*************************************************************************
+ * zcpp-tokens.h - This file is part of zcpp.                            *
+ * Copyright (C) 2020 XNSC                                               *
+ *                                                                       *
+ * This program is free software: you can redistribute it and/or modify  *
+ * it under the terms of the GNU General Public License as published by  *
+ * the Free Software Foundation, either version 3 of the License, or     *
+ * (at your option) any later version.                                   *
+ *                                                                       *
+ * This program is distributed in the hope that it will be useful,       *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the          *
+ * GNU General Public License for more details.                          *
+ *                                                                       *
+ * You should have received a copy of the GNU General Public License     *
+ * along with this program. If not, see <https://www.gnu.org/licenses/>. *
+ *************************************************************************/
+
+/* Layout of the token stream written by zcpp --emit=tokens. The stream
+   can be mapped into memory and used in place; all integers are in the
+   byte order of the machine that wrote it and all offsets are from the
+   start of the stream.
+
+   The stream begins with a header, followed by the string table, the
+   tokens, the location table and the bytes of the strings. Identifiers,
+   literals and punctuators are stored once in the string table and
+   tokens refer to them by index.
+
+   The bytes of a resource included with #embed are a single token of
+   kind ZCPP_TOKEN_EMBED whose spelling is the raw bytes, standing for the
+   comma-separated list of their values.
+
+   Each location entry gives the line and file of a token. The line of
+   every later token is the line of the one before it, plus one if it has
+   ZCPP_TOKEN_START_OF_LINE set, until the next entry. */
+
+#ifndef _ZCPP_TOKENS_H
+#define _ZCPP_TOKENS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ZCPP_TOKENS_MAGIC "ZCPPTOK1"
+
+#define ZCPP_TOKEN_IDENTIFIER 1
+#define ZCPP_TOKEN_NUMBER 2
+#define ZCPP_TOKEN_CHAR 3
+#define ZCPP_TOKEN_STRING 4
+#define ZCPP_TOKEN_PUNCTUATOR 5
+#define ZCPP_TOKEN_OTHER 6
+#define ZCPP_TOKEN_EMBED 7
+
+#define ZCPP_TOKEN_LEADING_SPACE 1
+#define ZCPP_TOKEN_START_OF_LINE 2
+
+struct zcpp_tokens_header
+{
+  char magic[8];
+  uint32_t string_count;
+  uint32_t token_count;
+  uint32_t location_count;
+  uint32_t reserved;
+  uint64_t strings;
+  uint64_t tokens;
+  uint64_t locations;
+  uint64_t data;
+};
+
+struct zcpp_string
+{
+  uint32_t offset; /* From the start of the string bytes */
+  uint32_t length;
+};
+
+/* Kind in the low three bits, then the flags, then the index of the
+   spelling in the string table */
+
+struct zcpp_token
+{
+  uint32_t bits;
+};
+
+#define ZCPP_TOKEN_SPELLING_SHIFT 5
+#define ZCPP_TOKEN_MAX_SPELLING ((uint32_t) 1 << 27)
+
+struct zcpp_location
+{
+  uint32_t token;
+  uint32_t line;
+  uint32_t file; /* Index into the string table */
+};
+
+static inline unsigned int
+zcpp_token_kind (const struct zcpp_token *token)
+{
+  return token->bits & 7;
+}
+
+static inline unsigned int
+zcpp_token_flags (const struct zcpp_token *token)
+{
+  return token->bits >> 3 & 3;
+}
+
+static inline uint32_t
+zcpp_token_spelling (const struct zcpp_token *token)
+{
+  return token->bits >> ZCPP_TOKEN_SPELLING_SHIFT;
+}
+
+/* Returns the header of a stream of the given size, or NULL if it is not
+   a valid token stream. Every string is checked to lie within the stream,
+   so this takes time in proportion to the number of strings. */
+
+static inline const struct zcpp_tokens_header *
+zcpp_tokens_open (const void *data, size_t size)
+{
+  const struct zcpp_tokens_header *header =
+    (const struct zcpp_tokens_header *) data;
+  const struct zcpp_string *strings;
+  uint32_t i;
+  if (size < sizeof *header
+      || memcmp (header->magic, ZCPP_TOKENS_MAGIC, 8) != 0
+      || header->strings + (uint64_t) header->string_count
+      * sizeof (struct zcpp_string) > size
+      || header->tokens + (uint64_t) header->token_count
+      * sizeof (struct zcpp_token) > size
+      || header->locations + (uint64_t) header->location_count
+      * sizeof (struct zcpp_location) > size
+      || header->data > size)
+    return NULL;
+  strings = (const struct zcpp_string *) ((const char *) data +
+					  header->strings);
+  for (i = 0; i < header->string_count; i++)
+    {
+      if ((uint64_t) strings[i].offset + strings[i].length
+	  > size - header->data)
+	return NULL;
+    }
+  return header;
+}
+
+static inline const struct zcpp_token *
+zcpp_tokens_begin (const struct zcpp_tokens_header *header)
+{
+  return (const struct zcpp_token *) ((const char *) header + header->tokens);
+}
+
+static inline const struct zcpp_token *
+zcpp_tokens_end (const struct zcpp_tokens_header *header)
+{
+  return zcpp_tokens_begin (header) + header->token_count;
+}
+
+static inline const struct zcpp_location *
+zcpp_tokens_locations (const struct zcpp_tokens_header *header)
+{
+  return (const struct zcpp_location *) ((const char *) header +
+					 header->locations);
+}
+
+/* Returns the bytes of a string, which are not NUL-terminated */
+
+static inline const char *
+zcpp_tokens_string (const struct zcpp_tokens_header *header, uint32_t id,
+		    uint32_t *length)
+{
+  const struct zcpp_string *s =
+    (const struct zcpp_string *) ((const char *) header + header->strings) +
+    id;
+  *length = s->length;
+  return (const char *) header + header->data + s->offset;
+}
+
+#endif
@@ -16,10 +16,13 @@
  * along with this program. If not, see <https://www.gnu.org/licenses/>. *
  *************************************************************************/
 
+#include <climits>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <sstream>
 #include "zcpp.hh"
 
 #define GUARD_REQUIRED_ARG if (i >= argc - 1)		\
@@ -32,9 +35,13 @@
 std::istream *input = &std::cin;
 std::string input_filename = "<stdin>";
 std::ostream *output = &std::cout;
+std::string output_filename;
 bool reserved[2];
-
-bool zcpp::verbose;
+bool watch;
+bool pipeline;
+bool overlay_stdin;
+std::string batch_dir;
+std::vector <std::string> filenames;
 
 static std::map <std::string, int> includetypes = {
   {"-idirafter", zcpp::include::dirafter},
@@ -47,16 +54,56 @@ static struct
   const char *flag;
   const char *desc;
 } options[] = {
+  {"--batch=DIR", "Preprocess each input file into a file in DIR"},
+  {"--cache-dir=DIR", "Reuse output of earlier runs stored in DIR"},
+  {"--cache-size=N", "Limit the size of the cache to N megabytes"},
+  {"--config=FILE[:DEFS]",
+   "Write output to FILE with DEFS (NAME[=VALUE],...) defined"},
+  {"--diagnostics=FORMAT", "Write messages as text (default) or JSON lines"},
+  {"--emit=FORMAT", "Write output as text (default) or binary tokens"},
   {"-h, --help", "Show this help text and exit"},
   {"-idirafter DIR", "Add DIR to the end of the include search path"},
   {"-iquote DIR", "Add DIR to the quoted-only include search path"},
   {"-isystem DIR", "Add DIR to the system include search path"},
   {"-I DIR", "Add DIR to the default include search path"},
+  {"-fmax-include-depth=N", "Allow include files to be nested N deep"},
+  {"--max-expansion=N", "Allow macros to add N bytes to a line"},
+  {"--max-messages=N", "Show N messages of each kind (0 for all)"},
+  {"--max-output=N", "Stop after writing N bytes of output"},
+  {"--max-time=N", "Stop after running for N seconds (0 for no limit)"},
   {"-o FILE, --output=FILE", "Write output to FILE"},
+  {"--overlay=FILE", "Read files bundled in FILE (- for stdin) first"},
+  {"--pipeline", "Process stages of the input file on separate threads"},
+  {"--prefetch=N", "Read up to N include files ahead in the background"},
+  {"--speculate=N", "Preprocess N upcoming includes ahead (no --prefetch)"},
+  {"--strip-threads=N", "Strip comments from large files on N threads"},
   {"-v, --verbose", "Write verbose output"},
-  {"--version", "Show the version of this program and exit"}
+  {"--version", "Show the version of this program and exit"},
+  {"--watch", "Preprocess again whenever an input file changes"}
 };
 
+/* Returns true if arg has the form NAME=N, and sets value to N times
+   scale if N is a valid number and that is no greater than limit */
+
+template <typename T>
+static bool
+numeric_option (const std::string &arg, const std::string &name, T &value,
+		T scale = 1, T limit = std::numeric_limits <T>::max ())
+{
+  if (arg.rfind (name + '=', 0) != 0)
+    return false;
+  std::string num = arg.substr (name.size () + 1);
+  if (num.empty () || num.size () > 18
+      || num.find_first_not_of ("0123456789") != std::string::npos)
+    zcpp::error ("argument of " + zcpp::bold (name) + " must be a number");
+  else if (std::stoull (num) > limit / scale)
+    zcpp::error ("argument of " + zcpp::bold (name) + " must be at most " +
+		 std::to_string (limit / scale));
+  else
+    value = std::stoull (num) * scale;
+  return true;
+}
+
 static void
 usage (void)
 {
@@ -73,34 +120,13 @@ version (void)
 }
 
 int
-main (int argc, char **argv)
+main (int argc, char **argv) try
 {
   zcpp::filestack.push
     (std::make_unique <zcpp::translation_unit> ("<command-line>", std::cin));
   zcpp::init_console ();
   zcpp::includes.emplace_back (".", zcpp::include::quote);
 
-  /* Define default macros */
-  zcpp::define ("__STDC__", "1");
-  zcpp::define ("__STDC_HOSTED__", "1");
-  zcpp::define ("__STDC_VERSION__", "199409L");
-  zcpp::define ("__CHAR_BIT__", "8");
-  zcpp::define ("__SIZEOF_INT__", SIZEOF_INT);
-  zcpp::define ("__SIZEOF_LONG__", SIZEOF_LONG);
-  zcpp::define ("__SIZEOF_LONG_LONG__", SIZEOF_LONG_LONG);
-  zcpp::define ("__SIZEOF_SHORT__", SIZEOF_SHORT);
-  zcpp::define ("__SIZEOF_POINTER__", SIZEOF_POINTER);
-  zcpp::define ("__SIZEOF_FLOAT__", SIZEOF_FLOAT);
-  zcpp::define ("__SIZEOF_DOUBLE__", SIZEOF_DOUBLE);
-  zcpp::define ("__SIZEOF_LONG_DOUBLE__", SIZEOF_LONG_DOUBLE);
-  zcpp::define ("__SIZEOF_SIZE_T__", SIZEOF_SIZE_T);
-  zcpp::define ("__SIZEOF_WCHAR_T__", SIZEOF_WCHAR_T);
-  zcpp::define ("__SIZEOF_WINT_T__", SIZEOF_WINT_T);
-  zcpp::define ("__SIZEOF_PTRDIFF_T__", SIZEOF_PTRDIFF_T);
-  zcpp::define (ARCH_MACRO, "1");
-  zcpp::define ("__has_attribute x", "0"); /* Don't support any attributes */
-  zcpp::define ("__has_feature x", "0");
-
   bool parsing_opts = true;
   for (int i = 1; i < argc; i++)
     {
@@ -114,6 +140,97 @@ main (int argc, char **argv)
 	      usage ();
 	      std::exit (0);
 	    }
+	  if (arg.rfind ("--batch=", 0) == 0)
+	    {
+	      arg.erase (0, 8);
+	      if (arg.empty ())
+		{
+		  zcpp::error ("argument of " + zcpp::bold ("--batch") +
+			       " must be a valid path");
+		  continue;
+		}
+	      batch_dir = arg;
+	      continue;
+	    }
+	  if (arg.rfind ("--cache-dir=", 0) == 0)
+	    {
+	      arg.erase (0, 12);
+	      if (arg.empty ())
+		{
+		  zcpp::error ("argument of " + zcpp::bold ("--cache-dir") +
+			       " must be a valid path");
+		  continue;
+		}
+	      zcpp::cache_dir = arg;
+	      continue;
+	    }
+	  if (arg.rfind ("--config=", 0) == 0)
+	    {
+	      arg.erase (0, 9);
+	      zcpp::configuration config;
+	      std::size_t sep = arg.find (':');
+	      config.output = arg.substr (0, sep);
+	      if (config.output.empty ())
+		{
+		  zcpp::error ("output filename cannot be empty");
+		  continue;
+		}
+	      while (sep != std::string::npos)
+		{
+		  std::size_t start = sep + 1;
+		  sep = arg.find (',', start);
+		  std::string def = arg.substr (start, sep - start);
+		  std::size_t eq = def.find ('=');
+		  if (def.empty ())
+		    continue;
+		  else if (eq == std::string::npos)
+		    config.macros.emplace_back (def, "1");
+		  else
+		    config.macros.emplace_back (def.substr (0, eq),
+						def.substr (eq + 1));
+		}
+	      zcpp::configs.push_back (std::move (config));
+	      continue;
+	    }
+	  if (arg.rfind ("--diagnostics=", 0) == 0)
+	    {
+	      arg.erase (0, 14);
+	      if (arg == "json")
+		zcpp::json_diagnostics = true;
+	      else if (arg == "text")
+		zcpp::json_diagnostics = false;
+	      else
+		zcpp::error ("argument of " + zcpp::bold ("--diagnostics") +
+			     " must be " + zcpp::bold ("text") + " or " +
+			     zcpp::bold ("json"));
+	      continue;
+	    }
+	  if (arg.rfind ("--emit=", 0) == 0)
+	    {
+	      arg.erase (0, 7);
+	      if (arg == "tokens")
+		zcpp::emit_tokens = true;
+	      else if (arg == "text")
+		zcpp::emit_tokens = false;
+	      else
+		zcpp::error ("argument of " + zcpp::bold ("--emit") +
+			     " must be " + zcpp::bold ("text") + " or " +
+			     zcpp::bold ("tokens"));
+	      continue;
+	    }
+	  if (numeric_option (arg, "--cache-size", zcpp::cache_size,
+			      (std::uintmax_t) 1024 * 1024)
+	      || numeric_option (arg, "-fmax-include-depth",
+				 zcpp::max_include_depth)
+	      || numeric_option (arg, "--max-expansion", zcpp::max_expansion)
+	      || numeric_option (arg, "--max-messages", zcpp::max_messages)
+	      || numeric_option (arg, "--max-output", zcpp::max_output)
+	      || numeric_option (arg, "--max-time", zcpp::max_time)
+	      || numeric_option (arg, "--prefetch", zcpp::prefetch_threads)
+	      || numeric_option (arg, "--speculate", zcpp::speculate_jobs)
+	      || numeric_option (arg, "--strip-threads", zcpp::strip_threads,
+				 1U, UINT_MAX - 1))
+	    continue;
 	  if (arg == "-idirafter" || arg == "-iquote" || arg == "-isystem")
 	    {
 	      GUARD_REQUIRED_ARG;
@@ -156,6 +273,7 @@ main (int argc, char **argv)
 		  continue;
 		}
 	      output = new std::ofstream (filename);
+	      output_filename = filename;
 	      reserved[1] = true;
 	      if (output == nullptr || !output->good ())
 	        zcpp::error ("failed to open output file " +
@@ -172,6 +290,7 @@ main (int argc, char **argv)
 		  continue;
 		}
 	      output = new std::ofstream (arg);
+	      output_filename = arg;
 	      reserved[1] = true;
 	      if (output == nullptr || !output->good ())
 		zcpp::error ("failed to open output file " +
@@ -179,6 +298,19 @@ main (int argc, char **argv)
 			     std::strerror (errno));
 	      continue;
 	    }
+	  if (arg.rfind ("--overlay=", 0) == 0)
+	    {
+	      arg.erase (0, 10);
+	      if (arg == "-")
+		overlay_stdin = true;
+	      zcpp::load_overlay (arg);
+	      continue;
+	    }
+	  if (arg == "--pipeline")
+	    {
+	      pipeline = true;
+	      continue;
+	    }
 	  if (arg == "-v" || arg == "--verbose")
 	    {
 	      zcpp::verbose = true;
@@ -189,6 +321,11 @@ main (int argc, char **argv)
 	      version ();
 	      std::exit (0);
 	    }
+	  if (arg == "--watch")
+	    {
+	      watch = true;
+	      continue;
+	    }
 	  if (arg == "--")
 	    {
 	      parsing_opts = false;
@@ -196,34 +333,86 @@ main (int argc, char **argv)
 	    }
 	  zcpp::error ("unrecognized command-line option: " + arg);
 	}
-      else if (!reserved[0])
-	{
-	  input = new std::ifstream (arg);
-	  input_filename = arg;
-	  if (input == nullptr || !input->good ())
-	    zcpp::error ("failed to open input file " + zcpp::bold (arg) +
-			 ": " + std::strerror (errno));
-	  reserved[0] = true;
-	}
-      else if (!reserved[1])
+      else
+	filenames.push_back (arg);
+    }
+  /* Without --batch the files are the input and the output file, and
+     --batch may come after them */
+  if (batch_dir.empty ())
+    {
+      for (const std::string &arg : filenames)
 	{
-	  output = new std::ofstream (arg);
-	  if (output == nullptr || !output->good ())
-	    zcpp::error ("failed to open output file " + zcpp::bold (arg) +
-			 ": " + std::strerror (errno));
-	  reserved[1] = true;
+	  if (!reserved[0])
+	    {
+	      input_filename = arg;
+	      reserved[0] = true;
+	    }
+	  else if (!reserved[1])
+	    {
+	      output = new std::ofstream (arg);
+	      output_filename = arg;
+	      if (output == nullptr || !output->good ())
+		zcpp::error ("failed to open output file " + zcpp::bold (arg) +
+			     ": " + std::strerror (errno));
+	      reserved[1] = true;
+	    }
+	  else
+	    zcpp::error ("too many files specified");
 	}
-      else
-	zcpp::error ("too many files specified");
+      filenames.clear ();
+    }
+  else if (filenames.empty ())
+    zcpp::error (zcpp::bold ("--batch") + " requires input files");
+  /* The input file is opened once every overlay is known */
+  if (reserved[0])
+    {
+      input = zcpp::files->open (input_filename).release ();
+      if (input == nullptr)
+	zcpp::error ("failed to open input file " +
+		     zcpp::bold (input_filename) + ": " +
+		     std::strerror (errno));
     }
+  else if (overlay_stdin && filenames.empty ())
+    zcpp::error (zcpp::bold ("--overlay=-") + " requires an input file");
+  if (watch && (!reserved[0] || !reserved[1]))
+    zcpp::error (zcpp::bold ("--watch") + " requires input and output files");
+  if (!zcpp::configs.empty ()
+      && (reserved[1] || watch || pipeline || !zcpp::cache_dir.empty ()))
+    zcpp::error (zcpp::bold ("--config") + " cannot be used with an output "
+		 "file, " + zcpp::bold ("--cache-dir") + ", " +
+		 zcpp::bold ("--pipeline") + " or " + zcpp::bold ("--watch"));
+  if (!batch_dir.empty ()
+      && (reserved[1] || !zcpp::configs.empty () || watch || pipeline
+	  || !zcpp::cache_dir.empty () || zcpp::speculate_jobs > 0))
+    zcpp::error (zcpp::bold ("--batch") + " cannot be used with an output "
+		 "file, " + zcpp::bold ("--cache-dir") + ", " +
+		 zcpp::bold ("--config") + ", " + zcpp::bold ("--pipeline") +
+		 ", " + zcpp::bold ("--speculate") + " or " +
+		 zcpp::bold ("--watch"));
+  if (pipeline && watch)
+    zcpp::error (zcpp::bold ("--pipeline") + " cannot be used with " +
+		 zcpp::bold ("--watch"));
+  if (zcpp::speculate_jobs > 0
+      && (!zcpp::configs.empty () || watch || pipeline
+	  || !zcpp::cache_dir.empty ()))
+    zcpp::error (zcpp::bold ("--speculate") + " cannot be used with " +
+		 zcpp::bold ("--cache-dir") + ", " + zcpp::bold ("--config") +
+		 ", " + zcpp::bold ("--pipeline") + " or " +
+		 zcpp::bold ("--watch"));
   if (zcpp::exiting)
     std::exit (1);
 
-  zcpp::add_includedir ("/usr/local/include", zcpp::include::system);
-  zcpp::add_includedir ("/usr/include", zcpp::include::system);
+  /* Only the thread that forks is copied into a speculation, so a lock
+     held by a prefetch worker at the time would never be released */
+  if (zcpp::speculate_jobs > 0)
+    zcpp::prefetch_threads = 0;
+  zcpp::join_jobserver ();
 
+  /* The files of a batch all share one directory */
+  const std::string &first_input =
+    filenames.empty () ? input_filename : filenames.front ();
   std::string input_path =
-    std::filesystem::path (input_filename).parent_path ();
+    std::filesystem::path (first_input).parent_path ();
   if (input_path.empty ())
     zcpp::includes.front ().path = ".";
   else
@@ -231,6 +420,7 @@ main (int argc, char **argv)
 
   if (zcpp::verbose)
     {
+      zcpp::add_system_includes ();
       std::cerr << "Include search path" << std::endl;
       for (const zcpp::include &dir : zcpp::includes)
 	{
@@ -241,9 +431,90 @@ main (int argc, char **argv)
 	}
     }
 
-  std::string result = zcpp::preprocess (input_filename, *input);
+  if (!batch_dir.empty ())
+    return zcpp::preprocess_batch (filenames, batch_dir);
+  if (!zcpp::configs.empty ())
+    return zcpp::preprocess_configs (input_filename, *input);
+  if (watch)
+    return zcpp::watch (input_filename, output_filename);
+
+  /* Tokens are written from the complete text once it is known to be
+     free of errors */
+  std::ostringstream text;
+  std::ostream *sink = zcpp::emit_tokens ? &text : output;
+  zcpp::start_budget ();
+  if (pipeline)
+    {
+      /* Output is only written as it is made if it can be taken back,
+	 since nothing should be left of it if there is an error */
+      std::error_code ec;
+      bool streamed = sink == output && reserved[1]
+	&& std::filesystem::is_regular_file (output_filename, ec);
+      std::ostringstream held;
+      try
+	{
+	  zcpp::preprocess_pipelined (input_filename, *input,
+				      streamed ? *sink : held);
+	}
+      catch (const zcpp::fatal_error &)
+	{
+	  /* Already reported, and it set exiting */
+	}
+      if (!zcpp::exiting && !streamed)
+	*sink << held.str ();
+      else if (zcpp::exiting && streamed)
+	{
+	  delete output;
+	  output = new std::ofstream (output_filename);
+	}
+    }
+  else if (!zcpp::cache_dir.empty ())
+    {
+      std::ostringstream stream;
+      stream << input->rdbuf ();
+      std::string contents = stream.str ();
+      if (!zcpp::cache_lookup (input_filename, contents, *sink))
+	{
+	  std::istringstream file (contents);
+	  std::string result = zcpp::preprocess (input_filename, file);
+	  if (!zcpp::exiting)
+	    {
+	      *sink << result;
+	      zcpp::cache_store (result);
+	    }
+	}
+    }
+  else
+    {
+      std::string result = zcpp::preprocess (input_filename, *input);
+      if (!zcpp::exiting)
+	*sink << result;
+    }
+  if (zcpp::emit_tokens && !zcpp::exiting)
+    zcpp::write_tokens (text.str (), *output);
+  output->flush ();
+  zcpp::flush_diagnostics ();
   if (zcpp::exiting)
     std::exit (1);
-  *output << result;
+  if (zcpp::verbose && zcpp::prefetch_threads > 0)
+    std::cerr << "Include files read ahead: " << zcpp::prefetch_hits
+	      << std::endl;
+  if (zcpp::verbose && zcpp::regions_replayed > 0)
+    std::cerr << "Include files replayed from earlier inclusions: "
+	      << zcpp::regions_replayed << " of " << zcpp::regions_entered
+	      << std::endl;
+  if (zcpp::verbose && zcpp::speculations_started > 0)
+    std::cerr << "Include files preprocessed ahead: "
+	      << zcpp::speculations_used << " of "
+	      << zcpp::speculations_started << std::endl;
+  if (zcpp::verbose && zcpp::if_cache_lookups > 0)
+    std::cerr << "#if expressions reused: " << zcpp::if_cache_hits << " of "
+	      << zcpp::if_cache_lookups << " ("
+	      << zcpp::if_cache_hits * 100 / zcpp::if_cache_lookups << "%)"
+	      << std::endl;
   return 0;
 }
+catch (const zcpp::fatal_error &)
+{
+  return 1;
+}
@@ -19,14 +19,44 @@
 #ifndef _ZCPP_HH
 #define _ZCPP_HH
 
+#include <array>
+#include <cstdint>
+#include <functional>
 #include <istream>
 #include <map>
 #include <memory>
+#include <set>
 #include <stack>
 #include <string>
+#include <string_view>
 #include <vector>
 #include "config.h"
 
+/* Size of the filter of defined macro names */
+#define MACRO_FILTER_BITS 131072
+
+/* Static tracepoints for perf and bpftrace. Without a tracer attached
+   each is a single nop. The probes and their arguments are:
+
+   file__enter      filename, depth
+   file__read       filename, depth, bytes left after removing comments
+   file__exit       filename, depth, bytes of output
+   include__lookup  header name, whether it is #include_next
+   include__result  header name, filename or NULL if not found
+   macro__define    name, length of name, whether it takes arguments
+   macro__undef     name
+   expand__begin    name, length of name
+   expand__end      name, length of name, arguments, bytes of output or 0
+                    if the arguments were wrong
+   if__eval         expression, length, result, whether it was cached
+   diagnostic       whether it is an error, filename, line, message */
+#ifdef ENABLE_PROBES
+#include <sys/sdt.h>
+#define ZCPP_PROBE(...) STAP_PROBEV (zcpp, __VA_ARGS__)
+#else
+#define ZCPP_PROBE(...)
+#endif
+
 namespace zcpp
 {
   class translation_unit
@@ -36,11 +66,66 @@ namespace zcpp
     std::string output;
     std::istream &file;
     std::size_t line;
+    std::size_t dir; /* Index of the include directory containing the file */
+
+    translation_unit (std::string filename, std::istream &file,
+		      std::size_t dir = std::string::npos) :
+      filename (std::move (filename)), file (file), line (1), dir (dir) {}
+  };
+
+  /* Stage 1: replaces comments with whitespace and joins lines ending in
+     a backslash. Messages can be deferred so that the work can be done
+     on another thread. */
+  class comment_stripper
+  {
+  public:
+    /* What is still open at a line boundary */
+    class state
+    {
+    public:
+      char quote = '\0';
+      bool comment = false;
+      int realign = 0; /* Lines joined since the last line marker */
+
+      bool
+      operator== (const state &other) const
+      {
+	return quote == other.quote && comment == other.comment
+	  && realign == other.realign;
+      }
+    };
+
+    translation_unit &unit;
+    bool defer;
+
+    comment_stripper (translation_unit &unit, bool defer = false);
+    comment_stripper (translation_unit &unit, std::string_view text,
+		      const state &entry, bool partial);
+    bool run (std::string &result, std::size_t limit);
+    void flush_messages (void);
+    const state &exit_state (void) const { return open; }
+
+  private:
+    std::string buffer; /* Input read from the file so far */
+    std::string_view text; /* Input, in buffer or already in memory */
+    bool in_memory;
+    std::size_t pos;
+    state open;
+    bool partial; /* The input stops part way through the file */
+    std::vector <std::pair <bool, std::string>> messages;
 
-    translation_unit (std::string filename, std::istream &file) :
-      filename (std::move (filename)), file (file), line (1) {}
+    bool fill (void);
+    bool ensure (std::size_t n);
+    bool splice (std::string &result);
+    bool skip_comment (std::string &result);
+    bool literal_closes (void);
+    void report (bool is_error, std::string msg);
   };
 
+  /* Identifiers that are not expanded, such as the parameters of a macro
+     while its body is expanded */
+  typedef std::set <std::string, std::less <>> name_set;
+
   class macro
   {
   public:
@@ -48,8 +133,190 @@ namespace zcpp
     bool func;
     std::vector <std::string> sub;
 
-    explicit macro (std::string value);
-    macro (std::vector <std::string> args, std::string value);
+    /* For each piece of sub, one more than the index of the parameter it
+       names, or zero */
+    std::vector <std::size_t> params;
+    unsigned long serial; /* Unique for every definition */
+
+    explicit macro (std::string_view value);
+    macro (std::vector <std::string> args, std::string_view value);
+
+    /* Takes a body that is already expanded */
+    macro (bool func, std::vector <std::string> args, std::string_view body);
+
+  private:
+    void split (std::string_view body);
+  };
+
+  /* Bloom filter over every name that has been defined in any table.
+     Names are never taken out of it, so a name that is not in it is not
+     a macro in any table, and copies of a table don't need their own.
+     The predefined macros are in it from the start. */
+  extern std::array <std::uint64_t, MACRO_FILTER_BITS / 64> macro_filter;
+
+  constexpr std::uint64_t
+  name_hash (std::string_view name)
+  {
+    std::uint64_t h = 0xcbf29ce484222325ULL;
+    for (char c : name)
+      h = (h ^ (unsigned char) c) * 0x100000001b3ULL;
+    return h ^ h >> 29;
+  }
+
+  inline bool
+  maybe_macro (std::uint64_t hash)
+  {
+    std::uint64_t a = hash % MACRO_FILTER_BITS;
+    std::uint64_t b = (hash >> 32) % MACRO_FILTER_BITS;
+    return (macro_filter[a / 64] >> a % 64 & 1)
+      && (macro_filter[b / 64] >> b % 64 & 1);
+  }
+
+  /* Persistent hash array mapped trie of macros. Updates copy only the
+     path to the changed entry, so copying a table to take a snapshot is
+     constant time. Each table also keeps a fingerprint of its contents
+     that does not depend on the order macros were defined in.
+
+     The predefined macros are not in the trie. They are kept in a static
+     table that is searched when a name is not found in the trie, and are
+     only built the first time they are used. Undefining one leaves an
+     entry with no value in the trie that hides it. */
+  class macro_table
+  {
+  public:
+    macro_table (void) : count (0), print (0, 0) {}
+    const std::shared_ptr <macro> *find (std::string_view name) const
+    {
+      return find (name, name_hash (name));
+    }
+    const std::shared_ptr <macro> *find (std::string_view name,
+					 std::uint64_t hash) const;
+    bool set (std::string_view name, std::shared_ptr <macro> value);
+    bool erase (std::string_view name);
+    std::size_t size (void) const;
+    std::pair <std::uint64_t, std::uint64_t> fingerprint (void) const;
+
+    struct entry;
+    struct node;
+
+  private:
+    std::shared_ptr <const node> root;
+    std::size_t count;
+    std::pair <std::uint64_t, std::uint64_t> print;
+  };
+
+  /* Thrown by fatal once its message is reported. Whatever started
+     preprocessing a file catches it and calls abandon_files before doing
+     anything else. */
+  class fatal_error
+  {
+  };
+
+  class checkpoint
+  {
+  public:
+    std::size_t pos; /* Offset of the directive in the main file */
+    std::size_t length; /* Length of the output before the directive */
+    std::size_t line;
+    std::string filename; /* As changed by #line */
+    macro_table defines;
+    std::stack <bool> ifstack;
+    std::stack <bool> elifstack;
+  };
+
+  /* One set of macros to preprocess the input with, and the file to
+     write the output to */
+  class configuration
+  {
+  public:
+    std::string output;
+    std::vector <std::pair <std::string, std::string>> macros;
+  };
+
+  /* What processing an included file did: its output, the macros it read
+     and the macros it defined or removed. Doing it again with the same
+     definitions of the macros it read would have the same effect. */
+  class region
+  {
+  public:
+    std::string output;
+
+    /* Macros in the order they were first read, and their definitions at
+       the time, or nullptr if they were not defined */
+    std::vector <std::pair <std::string, std::shared_ptr <macro>>> reads;
+
+    /* Definitions in the order they were made, or nullptr for #undef */
+    std::vector <std::pair <std::string, std::shared_ptr <macro>>> writes;
+
+    /* How many files deep its includes went */
+    std::size_t depth = 0;
+
+    bool matches (void) const;
+    void replay (std::string &result) const;
+  };
+
+  /* Where input files, include files and resources are read from */
+  class vfs
+  {
+  public:
+    virtual ~vfs (void) = default;
+
+    /* Returns nullptr and sets errno if the file can't be opened */
+    virtual std::unique_ptr <std::istream> open (const std::string &path) = 0;
+    virtual bool is_file (const std::string &path) = 0;
+
+    /* Sets data to the contents of a file that is already in memory */
+    virtual bool
+    view (const std::string &, std::string_view &)
+    {
+      return false;
+    }
+  };
+
+  class disk_vfs : public vfs
+  {
+  public:
+    std::unique_ptr <std::istream> open (const std::string &path) override;
+    bool is_file (const std::string &path) override;
+  };
+
+  /* Files in memory owned by the caller, in front of another file system.
+     The memory must outlive every use of the overlay and is never
+     copied. Files can only be added before preprocessing starts. */
+  class overlay_vfs : public vfs
+  {
+  public:
+    explicit overlay_vfs (vfs &lower);
+    void add (const std::string &path, std::string_view data);
+    std::unique_ptr <std::istream> open (const std::string &path) override;
+    bool is_file (const std::string &path) override;
+    bool view (const std::string &path, std::string_view &data) override;
+
+  private:
+    vfs &lower;
+    std::string cwd;
+    std::map <std::string, std::string_view, std::less <>> files;
+
+    std::string key (const std::string &path) const;
+  };
+
+  /* Bytes of a resource for #embed, mapped into memory where the system
+     allows it. At most limit bytes are read. */
+  class embed_resource
+  {
+  public:
+    bool good;
+    std::string_view bytes;
+
+    embed_resource (const std::string &filename, std::uintmax_t limit);
+    embed_resource (const embed_resource &) = delete;
+    embed_resource &operator= (const embed_resource &) = delete;
+    ~embed_resource (void);
+
+  private:
+    void *map;
+    std::size_t map_size;
+    std::string copy;
   };
 
   class include
@@ -67,36 +334,194 @@ namespace zcpp
 					   type (type) {}
   };
 
+  /* A message as it was reported, kept to be reported again */
+  class message
+  {
+  public:
+    bool is_error;
+    std::string filename;
+    std::size_t line;
+    std::string text;
+  };
+
+  /* Fast 128-bit hash for cache keys, not suitable for cryptography */
+  class hash
+  {
+  public:
+    hash (void) : a (0x9e3779b97f4a7c15ULL), b (0x6a09e667f3bcc909ULL),
+		  length (0), used (0) {}
+    void update (const char *data, std::size_t size);
+    void update (const std::string &s);
+    std::pair <std::uint64_t, std::uint64_t> digest (void) const;
+    std::string hex (void) const;
+
+  private:
+    std::uint64_t a;
+    std::uint64_t b;
+    std::uint64_t length;
+    unsigned char buffer[8];
+    std::size_t used;
+
+    void mix (std::uint64_t word);
+  };
+
+  extern vfs *files;
   extern bool exiting;
   extern std::stack <std::unique_ptr <translation_unit>> filestack;
-  extern std::map <std::string, std::unique_ptr <macro>> defines;
+  extern macro_table defines;
   extern std::vector <include> includes;
+  extern unsigned int prefetch_threads;
+  extern unsigned int strip_threads;
+  extern unsigned int speculate_jobs;
+  extern bool jobserver;
+  extern unsigned long speculations_used;
+  extern unsigned long speculations_started;
+  extern unsigned long prefetch_hits;
+  extern unsigned long if_cache_hits;
+  extern unsigned long if_cache_lookups;
   extern bool verbose;
+  extern bool json_diagnostics;
+  extern unsigned long max_messages;
+  extern std::size_t max_include_depth;
+  extern std::size_t max_expansion;
+  extern std::uintmax_t max_output;
+  extern unsigned long max_time;
+  extern std::uintmax_t output_bytes;
+  extern unsigned long lines_charged;
+  extern std::string cache_dir;
+  extern std::uintmax_t cache_size;
+  extern bool watching;
+  extern std::vector <checkpoint> checkpoints;
+  extern bool emit_tokens;
+  extern std::vector <std::unique_ptr <embed_resource>> embedded;
+  extern std::vector <configuration> configs;
+  extern bool recording_region;
+  extern unsigned long regions_replayed;
+  extern unsigned long regions_entered;
+  extern bool sharing_prefix;
+
+  void start_budget (void);
+  void check_budget (void);
+  void check_include_depth (void);
+  [[noreturn]] void expansion_too_long (void);
+
+  /* Called for every line written to the output. The clock is only
+     checked once every 1024 lines since reading it is comparatively
+     slow. */
+  inline void
+  charge_line (std::size_t size)
+  {
+    output_bytes += size;
+    if (output_bytes > max_output || (++lines_charged & 1023) == 0)
+      check_budget ();
+  }
 
   std::string replace_comments_escapes (void);
 
   void init_console (void);
+  void flush_diagnostics (void);
+  void silence_diagnostics (void);
+  unsigned long diagnostics_reported (void);
+  void keep_messages (std::vector <message> *kept);
+  void report_again (const message &m);
   std::string bold (std::string s);
+  void warning (const translation_unit &unit, std::string msg);
   void warning (std::string msg);
+  void error (const translation_unit &unit, std::string msg);
   void error (std::string msg);
+  [[noreturn]] void fatal (std::string msg);
 
-  void define (std::string name, std::string value);
-  std::string expand (const std::string &s,
-		      std::vector <std::string> *reserved = nullptr);
+  void define (std::string_view name, std::string_view value);
+  bool is_defined (std::string_view name);
+  const std::shared_ptr <macro> *lookup (std::string_view name);
+  void expand (std::string &result, std::string_view s,
+	       const name_set *reserved = nullptr);
+  std::string expand (std::string_view s,
+		      const name_set *reserved = nullptr);
 
-  std::string parse_directives (void);
+  void parse_directives (std::string &result);
+  void parse_directives (const std::function <bool (std::string &)> &next,
+			 const std::function <void (std::string &)> &write);
+  std::string resume_directives (const checkpoint &from, std::string result);
 
-  int next_char (void);
   void change_line (unsigned long line, std::string *filename);
-  std::string preprocess (std::string filename, std::istream &file);
+  void preprocess (std::string &result, std::string filename,
+		   std::istream &file, std::size_t dir = std::string::npos);
+  std::string preprocess (std::string filename, std::istream &file,
+			  std::size_t dir = std::string::npos);
+  void abandon_files (void);
+  void reset_directives (void);
+  void forget_conditions (void);
+
+  bool parse_overlay (std::string_view data, overlay_vfs &overlay,
+		      std::string *first = nullptr);
+  bool load_overlay (const std::string &filename);
+  bool memory_view (std::istream &file, std::string_view &data);
 
   void add_includedir (std::string path, int type);
+  void add_system_includes (void);
+  void forget_includes (void);
+  std::size_t find_include (const std::string &spec, std::size_t start,
+			    std::string &filename);
+  void embed (std::string &result, const std::string &filename,
+	      std::string_view params);
+  std::string stamp_file (const translation_unit &unit);
   std::string stamp_file (void);
 
-  bool expect_read_identifier (std::string &result, const std::string &input,
+  void preprocess_pipelined (std::string filename, std::istream &file,
+			     std::ostream &output);
+
+  bool cache_lookup (const std::string &filename, const std::string &contents,
+		     std::ostream &output);
+  void cache_include (const std::string &filename,
+		      std::string_view contents);
+  void cache_search (const std::string &spec, std::size_t start,
+		     const std::string &filename);
+  void cache_store (const std::string &result);
+
+  void prefetch_includes (const std::string &s);
+  bool take_prefetched (const std::string &spec, std::string &filename,
+			std::size_t &dir, std::string &contents);
+  void drop_prefetched (void);
+
+  void join_jobserver (void);
+  void leave_jobserver (void);
+  bool acquire_job (void);
+  void release_job (void);
+
+  void speculate_includes (std::string_view input, std::size_t pos);
+  bool splice_speculation (std::string &result, std::size_t pos);
+  void end_speculation (void);
+
+  void watch_dependency (const std::string &filename);
+  std::string *watch_file (const std::string &filename);
+  int watch (const std::string &filename, const std::string &outname);
+
+  void write_tokens (std::string_view text, std::ostream &output);
+
+  std::string *config_file (const std::string &filename);
+  bool replay_region (std::string &result, const std::string &filename);
+  bool begin_region (const std::string &filename);
+  void end_region (const std::string &filename, std::string_view output);
+  void start_recording (region &r);
+  bool stop_recording (void);
+  void drop_recordings (void);
+  void forget_regions (void);
+  void record_depth (std::size_t files);
+  void record_read (std::string_view name,
+		    const std::shared_ptr <macro> *value);
+  void record_write (std::string_view name, std::shared_ptr <macro> value);
+  int preprocess_configs (const std::string &filename, std::istream &file);
+
+  int preprocess_batch (const std::vector <std::string> &inputs,
+			const std::string &dir);
+  bool splice_prefix (std::string &result, std::string_view content);
+  void record_prefix (const std::string &result, std::size_t length);
+
+  bool expect_read_identifier (std::string &result, std::string_view input,
 			       std::size_t &pos, bool first_num = false,
 			       bool end_space = false, bool print_err = true);
-  void expect_read_string (std::string &result, const std::string &input,
+  void expect_read_string (std::string &result, std::string_view input,
 			   std::size_t &pos);
 }
 